@@ -0,0 +1,304 @@
+#include "AllocatorStats.h"
+#include "ArenaAllocator.h"
+#include "AutomatedBinding.h"
+#include "PropertyDispatch.h"
+#include "lua.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <string.h>
+#include <vector>
+
+/*
+ Microbenchmarks of the embedding layer. Every benchmark is run with a growing number of
+ operations until it takes at least the minimum time, then reported per operation:
+ time, and allocations / bytes asked of the lua_State's allocator (through StatsAllocator).
+
+ LuaEmbedBench [output.json] [--min-time=seconds]
+ Results are printed as JSON (to stdout, or to the file).
+ */
+
+struct BenchResult
+{
+    std::string m_name;
+    size_t m_iterations;
+    double m_nsPerOp;
+    double m_allocsPerOp;       // < 0: allocator not instrumented
+    double m_bytesPerOp;
+};
+
+struct Bench
+{
+    // Runs numOps operations
+    typedef void (*Body)(void* context, size_t numOps);
+
+    double m_minSeconds;
+    std::vector<BenchResult> m_results;
+
+    Bench(double minSeconds)
+    : m_minSeconds(minSeconds)
+    { }
+
+    // stats may be nullptr when the allocator can't be observed
+    void Run(const char* name, Body body, void* context, const AllocatorStats* stats)
+    {
+        body(context, 1);       // Warm up
+
+        size_t numOps = 1;
+        for (;;)
+        {
+            AllocatorStats before = stats ? *stats : AllocatorStats();
+            auto start = std::chrono::high_resolution_clock::now();
+            body(context, numOps);
+            auto end = std::chrono::high_resolution_clock::now();
+            double seconds = std::chrono::duration<double>(end - start).count();
+
+            if (seconds >= m_minSeconds || numOps >= (size_t(1) << 40))
+            {
+                BenchResult result;
+                result.m_name = name;
+                result.m_iterations = numOps;
+                result.m_nsPerOp = seconds * 1e9 / numOps;
+                result.m_allocsPerOp = -1.0;
+                result.m_bytesPerOp = -1.0;
+                if (stats)
+                {
+                    size_t allocs = (stats->m_allocations + stats->m_reallocations) - (before.m_allocations + before.m_reallocations);
+                    result.m_allocsPerOp = (double) allocs / numOps;
+                    result.m_bytesPerOp = (double) (stats->m_bytesAllocated - before.m_bytesAllocated) / numOps;
+                }
+                fprintf(stderr, "%-32s %12.1f ns/op\n", name, result.m_nsPerOp);
+                m_results.push_back(result);
+                return;
+            }
+
+            // Aim a bit past the minimum time
+            double scale = seconds > 0.0 ? 1.5 * m_minSeconds / seconds : 100.0;
+            scale = scale < 2.0 ? 2.0 : (scale > 100.0 ? 100.0 : scale);
+            numOps = (size_t) (numOps * scale);
+        }
+    }
+
+    void WriteJson(FILE* out) const
+    {
+        fprintf(out, "{\n  \"benchmarks\": [\n");
+        for (size_t i = 0; i < m_results.size(); i++)
+        {
+            const BenchResult& result = m_results[i];
+            fprintf(out, "    { \"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.3f, ",
+                    result.m_name.c_str(), (unsigned long long) result.m_iterations, result.m_nsPerOp);
+            if (result.m_allocsPerOp < 0.0)
+            {
+                fprintf(out, "\"allocs_per_op\": null, \"bytes_per_op\": null }");
+            }
+            else
+            {
+                fprintf(out, "\"allocs_per_op\": %.3f, \"bytes_per_op\": %.3f }", result.m_allocsPerOp, result.m_bytesPerOp);
+            }
+            fprintf(out, i + 1 < m_results.size() ? ",\n" : "\n");
+        }
+        fprintf(out, "  ]\n}\n");
+    }
+};
+
+// ---- Bound natives, as in the tutorial ----
+
+int NativePythagoras(lua_State* L)
+{
+    lua_Number a = lua_tonumber(L, -2);
+    lua_Number b = lua_tonumber(L, -1);
+    lua_pushnumber(L, (a * a) + (b * b));
+    return 1;
+}
+
+struct Sprite
+{
+    int x;
+    int y;
+};
+
+int CreateSprite(lua_State* L)
+{
+    Sprite* sprite = (Sprite*) lua_newuserdata(L, sizeof(Sprite));
+    new (sprite) Sprite();
+    lua_pushvalue(L, lua_upvalueindex(1));      // Metatable
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+int DestroySprite(lua_State* L)
+{
+    ((Sprite*) lua_touserdata(L, 1))->~Sprite();
+    return 0;
+}
+
+// Sprite table with new, metatable with __gc, __index and __newindex
+void BindSprite(lua_State* L)
+{
+    lua_newtable(L);
+    int spriteTableIdx = lua_gettop(L);
+    lua_newtable(L);
+    int metaTableIdx = lua_gettop(L);
+
+    lua_pushcfunction(L, DestroySprite);
+    lua_setfield(L, metaTableIdx, "__gc");
+
+    static PropertyDispatcher<Sprite>::Property properties[] =
+    {
+        { "x", [](lua_State* L, const Sprite& sprite) { lua_pushinteger(L, sprite.x); },
+               [](lua_State* L, Sprite& sprite, int valueIdx) { sprite.x = (int) lua_tointeger(L, valueIdx); } },
+        { "y", [](lua_State* L, const Sprite& sprite) { lua_pushinteger(L, sprite.y); },
+               [](lua_State* L, Sprite& sprite, int valueIdx) { sprite.y = (int) lua_tointeger(L, valueIdx); } },
+    };
+    PropertyDispatcher<Sprite>::Bind(L, metaTableIdx, spriteTableIdx, properties, 2);
+
+    lua_pushcclosure(L, CreateSprite, 1);
+    lua_setfield(L, spriteTableIdx, "new");
+    lua_setglobal(L, "Sprite");
+}
+
+// ---- Benchmark bodies ----
+
+void NewStateBody(void* /*context*/, size_t numOps)
+{
+    for (size_t i = 0; i < numOps; i++)
+    {
+        lua_close(luaL_newstate());
+    }
+}
+
+struct ArenaStateContext
+{
+    ArenaAllocator* m_arena;
+    StatsAllocator<ArenaAllocator>* m_stats;
+};
+
+void ArenaStateBody(void* context, size_t numOps)
+{
+    ArenaStateContext& ctx = *(ArenaStateContext*) context;
+    for (size_t i = 0; i < numOps; i++)
+    {
+        ctx.m_arena->Reset();
+        lua_close(lua_newstate(StaticAllocator<StatsAllocator<ArenaAllocator>>::l_alloc, ctx.m_stats));
+    }
+}
+
+void PcallBody(void* context, size_t numOps)
+{
+    lua_State* L = (lua_State*) context;
+    for (size_t i = 0; i < numOps; i++)
+    {
+        lua_getglobal(L, "Pythagoras");
+        lua_pushnumber(L, 3);
+        lua_pushnumber(L, 4);
+        lua_pcall(L, 2, 1, 0);
+        lua_pop(L, 1);
+    }
+}
+
+// A compiled lua loop (on the registry) running N operations
+struct ScriptContext
+{
+    lua_State* m_state;
+    int m_chunkRef;
+};
+
+void ScriptBody(void* context, size_t numOps)
+{
+    ScriptContext& ctx = *(ScriptContext*) context;
+    lua_State* L = ctx.m_state;
+    lua_pushinteger(L, (lua_Integer) numOps);
+    lua_setglobal(L, "N");
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ctx.m_chunkRef);
+    if (lua_pcall(L, 0, 0, 0) != LUA_OK)
+    {
+        fprintf(stderr, "Error: %s\n", lua_tostring(L, -1));
+        exit(1);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const char* outputPath = nullptr;
+    double minSeconds = 0.25;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--min-time=", 11) == 0)
+        {
+            minSeconds = atof(argv[i] + 11);
+        }
+        else
+        {
+            outputPath = argv[i];
+        }
+    }
+
+    Bench bench(minSeconds);
+
+    // State creation
+    bench.Run("state_create/luaL_newstate", NewStateBody, nullptr, nullptr);
+    {
+        std::vector<char> memory(1024 * 64);
+        ArenaAllocator arena(memory.data(), memory.data() + memory.size());
+        StatsAllocator<ArenaAllocator> stats(arena);
+        ArenaStateContext context = { &arena, &stats };
+        bench.Run("state_create/lua_newstate_arena", ArenaStateBody, &context, &stats.m_stats);
+    }
+
+    // Everything else runs in one instrumented state
+    GlobalAllocator globalAllocator;
+    StatsAllocator<GlobalAllocator> stats(globalAllocator);
+    lua_State* L = lua_newstate(StaticAllocator<StatsAllocator<GlobalAllocator>>::l_alloc, &stats);
+
+    luaL_dostring(L, "function Pythagoras(a, b) return (a * a) + (b * b) end");
+    bench.Run("pcall_round_trip", PcallBody, L, &stats.m_stats);
+
+    lua_pushcfunction(L, NativePythagoras);
+    lua_setglobal(L, "NativePythagoras");
+    BindSprite(L);
+    BindGlobalMethods(L, "Global");
+
+    struct
+    {
+        const char* m_name;
+        const char* m_script;
+    } scripts[] =
+    {
+        { "c_call/NativePythagoras", "local f = NativePythagoras for i = 1, N do f(3, 4) end" },
+        { "userdata/create_and_gc", "local new = Sprite.new for i = 1, N do new() end collectgarbage()" },
+        { "userdata/index_property", "local s, v = Sprite.new() for i = 1, N do v = s.x end" },
+        { "userdata/newindex_property", "local s = Sprite.new() for i = 1, N do s.y = i end" },
+        { "rttr/CallGlobalFromLua", "local Mul = Global.Mul for i = 1, N do Mul(i, 2) end" },
+    };
+
+    luaL_requiref(L, "_G", luaopen_base, 1);        // collectgarbage
+    lua_pop(L, 1);
+    for (auto& script : scripts)
+    {
+        if (luaL_loadstring(L, script.m_script) != LUA_OK)
+        {
+            fprintf(stderr, "Error: %s\n", lua_tostring(L, -1));
+            return 1;
+        }
+        ScriptContext context = { L, luaL_ref(L, LUA_REGISTRYINDEX) };
+        bench.Run(script.m_name, ScriptBody, &context, &stats.m_stats);
+        luaL_unref(L, LUA_REGISTRYINDEX, context.m_chunkRef);
+    }
+
+    lua_close(L);
+
+    FILE* out = outputPath ? fopen(outputPath, "w") : stdout;
+    if (out == nullptr)
+    {
+        fprintf(stderr, "Can't write '%s'\n", outputPath);
+        return 1;
+    }
+    bench.WriteJson(out);
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+    return 0;
+}
@@ -0,0 +1,240 @@
+#pragma once
+
+#include "ArenaAllocator.h"
+#include "ThreadArenaAllocator.h"
+#include "lua.hpp"
+
+/*
+ Snapshot of what a lua_State asked of its allocator.
+ Sizes are the ones lua requested (not rounded up to size classes).
+ */
+struct AllocatorStats
+{
+    // Bucket 0: sizes up to 16 bytes, bucket i: (2^(i+3), 2^(i+4)] bytes, last bucket: everything bigger
+    static constexpr int NUM_HISTOGRAM_BUCKETS = 16;
+
+    size_t m_liveBytes;
+    size_t m_peakBytes;
+    size_t m_allocations;
+    size_t m_frees;
+    size_t m_reallocations;
+    size_t m_bytesAllocated;        // Total asked for by allocations and reallocations (nsize), never decreases
+    size_t m_sizeHistogram[NUM_HISTOGRAM_BUCKETS];
+
+    // Filled in from the wrapped allocator, stays 0 when it doesn't track them
+    size_t m_freeListHits;
+    size_t m_freeListMisses;
+    size_t m_fallbacks;
+    size_t m_inPlaceReallocs;
+    size_t m_copyReallocs;
+    size_t m_reallocBytesCopied;
+
+    AllocatorStats()
+    {
+        memset(this, 0, sizeof(AllocatorStats));
+    }
+
+    static int HistogramBucket(size_t sizeBytes)
+    {
+        if (sizeBytes <= 16)
+        {
+            return 0;
+        }
+        int bucket = ArenaAllocator::FloorLog2(sizeBytes - 1) - 3;
+        return bucket < NUM_HISTOGRAM_BUCKETS ? bucket : NUM_HISTOGRAM_BUCKETS - 1;
+    }
+
+    // Largest size counted in a bucket
+    static size_t HistogramBucketLimit(int bucket)
+    {
+        return size_t(16) << bucket;
+    }
+
+    double FreeListHitRate() const
+    {
+        size_t lookups = m_freeListHits + m_freeListMisses;
+        return lookups ? (double) m_freeListHits / lookups : 0.0;
+    }
+};
+
+// Counters kept by the allocators themselves
+template <typename T>
+void CollectAllocatorCounters(const T& /*allocator*/, AllocatorStats& /*stats*/)
+{ }
+
+inline void CollectReAllocCounters(const ReAllocCounters& counters, AllocatorStats& stats)
+{
+    stats.m_inPlaceReallocs = counters.m_inPlace;
+    stats.m_copyReallocs = counters.m_copied;
+    stats.m_reallocBytesCopied = counters.m_bytesCopied;
+}
+
+inline void CollectAllocatorCounters(const GlobalAllocator& allocator, AllocatorStats& stats)
+{
+    CollectReAllocCounters(allocator.m_reallocCounters, stats);
+}
+
+inline void CollectAllocatorCounters(const ArenaAllocator& allocator, AllocatorStats& stats)
+{
+    CollectReAllocCounters(allocator.m_reallocCounters, stats);
+    stats.m_freeListHits = allocator.m_counters.m_freeListHits;
+    stats.m_freeListMisses = allocator.m_counters.m_freeListMisses;
+    stats.m_fallbacks = allocator.m_counters.m_fallbacks;
+}
+
+inline void CollectAllocatorCounters(const ThreadArena& allocator, AllocatorStats& stats)
+{
+    CollectAllocatorCounters(allocator.m_arena, stats);
+}
+
+// The allocator's own counters live as long as the allocator (a pooled arena serves many states):
+// only what happened since baseline was collected
+inline void SubtractAllocatorCounters(const AllocatorStats& baseline, AllocatorStats& stats)
+{
+    stats.m_freeListHits -= baseline.m_freeListHits;
+    stats.m_freeListMisses -= baseline.m_freeListMisses;
+    stats.m_fallbacks -= baseline.m_fallbacks;
+    stats.m_inPlaceReallocs -= baseline.m_inPlaceReallocs;
+    stats.m_copyReallocs -= baseline.m_copyReallocs;
+    stats.m_reallocBytesCopied -= baseline.m_reallocBytesCopied;
+}
+
+/*
+ Wraps any allocator and keeps AllocatorStats for the lua_State using it (one StatsAllocator per state).
+ Only a handful of increments per call, cheap enough to leave on in release builds.
+ The wrapped allocator's counters are reported from when the StatsAllocator was created.
+
+ StatsAllocator<ArenaAllocator> stats(pool);
+ lua_State* L = lua_newstate(StaticAllocator<StatsAllocator<ArenaAllocator>>::l_alloc, &stats);
+ stats.RegisterLuaFunction(L);          // AllocatorStats() from lua
+ */
+template <typename T>
+struct StatsAllocator
+    : public IAllocator<StatsAllocator<T>>
+{
+    T& m_allocator;
+    AllocatorStats m_stats;
+    AllocatorStats m_baseline;      // Wrapped allocator's counters at creation
+
+    StatsAllocator(T& allocator)
+    : m_allocator(allocator)
+    {
+        CollectAllocatorCounters(m_allocator, m_baseline);
+    }
+
+    void AddLiveBytes(size_t sizeBytes)
+    {
+        m_stats.m_liveBytes += sizeBytes;
+        if (m_stats.m_liveBytes > m_stats.m_peakBytes)
+        {
+            m_stats.m_peakBytes = m_stats.m_liveBytes;
+        }
+    }
+
+    void* Allocate(size_t sizeBytes) override
+    {
+        void* ptr = m_allocator.T::Allocate(sizeBytes);
+        if (ptr)
+        {
+            m_stats.m_allocations++;
+            m_stats.m_bytesAllocated += sizeBytes;
+            m_stats.m_sizeHistogram[AllocatorStats::HistogramBucket(sizeBytes)]++;
+            AddLiveBytes(sizeBytes);
+        }
+        return ptr;
+    }
+
+    void DeAllocate(void* ptr, size_t osize) override
+    {
+        m_allocator.T::DeAllocate(ptr, osize);
+        m_stats.m_frees++;
+        m_stats.m_liveBytes -= osize;
+    }
+
+    void* ReAllocate(void* ptr, size_t osize, size_t nsize) override
+    {
+        void* newPtr = m_allocator.T::ReAllocate(ptr, osize, nsize);
+        if (newPtr)
+        {
+            m_stats.m_reallocations++;
+            m_stats.m_bytesAllocated += nsize;
+            m_stats.m_sizeHistogram[AllocatorStats::HistogramBucket(nsize)]++;
+            m_stats.m_liveBytes -= osize;
+            AddLiveBytes(nsize);
+        }
+        return newPtr;
+    }
+
+    AllocatorStats GetStats() const
+    {
+        AllocatorStats stats = m_stats;
+        CollectAllocatorCounters(m_allocator, stats);
+        SubtractAllocatorCounters(m_baseline, stats);
+        return stats;
+    }
+
+    // Stats of a lua_State created with StatsAllocator<T> (either l_alloc), nullptr otherwise
+    static const StatsAllocator<T>* FromState(lua_State* L)
+    {
+        void* ud = nullptr;
+        lua_Alloc allocFunction = lua_getallocf(L, &ud);
+        if (allocFunction == StaticAllocator<StatsAllocator<T>>::l_alloc ||
+            allocFunction == IAllocator<StatsAllocator<T>>::l_alloc)
+        {
+            return static_cast<const StatsAllocator<T>*>(ud);
+        }
+        return nullptr;
+    }
+
+    static int LuaGetStats(lua_State* L)
+    {
+        StatsAllocator<T>* self = (StatsAllocator<T>*) lua_touserdata(L, lua_upvalueindex(1));
+        PushAllocatorStats(L, self->GetStats());
+        return 1;
+    }
+
+    // Binds a global lua function returning the stats as a table
+    void RegisterLuaFunction(lua_State* L, const char* name = "AllocatorStats")
+    {
+        lua_pushlightuserdata(L, this);
+        lua_pushcclosure(L, LuaGetStats, 1);
+        lua_setglobal(L, name);
+    }
+
+    // Pushes { liveBytes = ..., peakBytes = ..., histogram = { [16] = n, [32] = n ... }, ... }
+    static void PushAllocatorStats(lua_State* L, const AllocatorStats& stats)
+    {
+        lua_newtable(L);
+
+        auto SetField = [L](const char* name, size_t value)
+        {
+            lua_pushinteger(L, (lua_Integer) value);
+            lua_setfield(L, -2, name);
+        };
+
+        SetField("liveBytes", stats.m_liveBytes);
+        SetField("peakBytes", stats.m_peakBytes);
+        SetField("allocations", stats.m_allocations);
+        SetField("frees", stats.m_frees);
+        SetField("reallocations", stats.m_reallocations);
+        SetField("bytesAllocated", stats.m_bytesAllocated);
+        SetField("freeListHits", stats.m_freeListHits);
+        SetField("freeListMisses", stats.m_freeListMisses);
+        SetField("fallbacks", stats.m_fallbacks);
+        SetField("inPlaceReallocs", stats.m_inPlaceReallocs);
+        SetField("copyReallocs", stats.m_copyReallocs);
+        SetField("reallocBytesCopied", stats.m_reallocBytesCopied);
+
+        lua_pushnumber(L, stats.FreeListHitRate());
+        lua_setfield(L, -2, "freeListHitRate");
+
+        // Keyed by the largest size counted in each bucket
+        lua_newtable(L);
+        for (int i = 0; i < AllocatorStats::NUM_HISTOGRAM_BUCKETS; i++)
+        {
+            lua_pushinteger(L, (lua_Integer) stats.m_sizeHistogram[i]);
+            lua_rawseti(L, -2, (lua_Integer) AllocatorStats::HistogramBucketLimit(i));
+        }
+        lua_setfield(L, -2, "histogram");
+    }
+};
@@ -1,9 +1,23 @@
 #pragma once
 
 #include <assert.h>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <string.h>
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
 template <typename T>
 class IAllocator {
     
@@ -52,21 +66,101 @@ public:
     
 };
 
+/*
+ Compile-time allocator binding for lua_newstate, no virtual dispatch at all.
+ Policy can be any type with Allocate/DeAllocate/ReAllocate (it doesn't need to derive from IAllocator).
+ The calls are qualified with Policy:: so they are direct calls that can be inlined into l_alloc.
+ 
+ lua_State* L = lua_newstate(StaticAllocator<ArenaAllocator>::l_alloc, &pool);
+ */
+template <typename Policy>
+struct StaticAllocator
+{
+    static void* l_alloc (void *ud, void *ptr, size_t osize, size_t nsize)
+    {
+        Policy* policy = static_cast<Policy*>(ud);
+        
+        if (nsize == 0)
+        {
+            if (ptr)
+            {
+                policy->Policy::DeAllocate(ptr, osize);
+            }
+            return NULL;
+        }
+        
+        // Allocation
+        if (ptr == nullptr)
+        {
+            return policy->Policy::Allocate(nsize);
+        }
+        
+        // Reallocation
+        return policy->Policy::ReAllocate(ptr, osize, nsize);
+    }
+};
+
+/* How ReAllocate calls were satisfied, to measure how much memcpy traffic is avoided */
+struct ReAllocCounters
+{
+    size_t m_inPlace;       // Block grew or shrank without moving
+    size_t m_copied;        // Block moved to a new address
+    size_t m_bytesCopied;   // Bytes moved by the copying reallocations
+    
+    ReAllocCounters()
+    : m_inPlace(0),
+    m_copied(0),
+    m_bytesCopied(0)
+    { }
+    
+    void Record(bool inPlace, size_t bytesToCopy)
+    {
+        if (inPlace)
+        {
+            m_inPlace++;
+        }
+        else
+        {
+            m_copied++;
+            m_bytesCopied += bytesToCopy;
+        }
+    }
+};
+
+/* Where ArenaAllocator::Allocate found its memory */
+struct ArenaCounters
+{
+    size_t m_freeListHits;  // Reused a free'd block of the same size class
+    size_t m_freeListMisses; // Size class request with an empty free list (blocks bigger than any class aren't counted)
+    size_t m_carved;        // Carved from the pool with the bump pointer
+    size_t m_fallbacks;     // Handed over to the global allocator
+    
+    ArenaCounters()
+    : m_freeListHits(0),
+    m_freeListMisses(0),
+    m_carved(0),
+    m_fallbacks(0)
+    { }
+};
+
 /* Allocates from global memory */
 struct GlobalAllocator
     : IAllocator<GlobalAllocator>
 {
+    ReAllocCounters m_reallocCounters;
+    
     void* Allocate(size_t sizeBytes) override
     {
-        return ::operator new(sizeBytes);
+        return malloc(sizeBytes);
     }
     
     void DeAllocate(void* ptr, size_t /*osize*/) override
     {
         assert(ptr != nullptr); // Ensure we are not deallocating a nullptr
-        ::operator delete(ptr);
+        free(ptr);
     }
     
+    // realloc can grow or shrink the block in place when the heap has room after it
     void* ReAllocate(void* ptr, size_t osize, size_t nsize) override
     {
         
@@ -77,21 +171,81 @@ struct GlobalAllocator
             bytesToCopy = nsize;
         }
         
-        void* newPtr = Allocate(nsize);
-        memcpy(newPtr, ptr, bytesToCopy);
-        DeAllocate(ptr, osize);
+        // Compared as an integer afterwards: once realloc moved the block, ptr is freed and must not be used
+        uintptr_t oldAddress = (uintptr_t) ptr;
+        void* newPtr = realloc(ptr, nsize);
+        
+        // Lua expects a shrink to never fail, the old block is still big enough
+        if (newPtr == nullptr)
+        {
+            return nsize <= osize ? ptr : nullptr;
+        }
+        
+        m_reallocCounters.Record((uintptr_t) newPtr == oldAddress, bytesToCopy);
         return newPtr;
     }
     
 };
 
 
+/* Maps pages straight from the OS (mmap / VirtualAlloc), bypassing the C heap */
+struct PageAllocator
+{
+    static constexpr size_t PAGE_SIZE = 4096;
+    
+    static size_t RoundUpToPage(size_t sizeBytes)
+    {
+        return (sizeBytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    }
+    
+    // Returns nullptr when the OS refuses
+    static void* Map(size_t sizeBytes)
+    {
+#if defined(_WIN32)
+        return VirtualAlloc(nullptr, sizeBytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+        void* ptr = mmap(nullptr, sizeBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return ptr == MAP_FAILED ? nullptr : ptr;
+#endif
+    }
+    
+    static void Unmap(void* ptr, size_t sizeBytes)
+    {
+#if defined(_WIN32)
+        (void) sizeBytes;
+        VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+        munmap(ptr, sizeBytes);
+#endif
+    }
+    
+    // Gives back the pages past keepBytes (both page multiples), the first keepBytes stay mapped
+    static void UnmapTail(void* ptr, size_t sizeBytes, size_t keepBytes)
+    {
+        char* tail = static_cast<char*>(ptr) + keepBytes;
+#if defined(_WIN32)
+        // A reservation is only ever released whole: decommit the pages now, Unmap releases the rest
+        VirtualFree(tail, sizeBytes - keepBytes, MEM_DECOMMIT);
+#else
+        munmap(tail, sizeBytes - keepBytes);
+#endif
+    }
+};
+
 /*
  Allocates from a fixed pool.
  Aligns all memory to 8 bytes
- Has a min allocation of 64 bytes
- Puts all free'd blocks onto free linked list
- When out of memory, falls back onto GlobalAllocator
+ Rounds every allocation up to a size class (16, 32, ... 128, then 4 classes per power of two up to 64KB)
+ Keeps one free linked list per size class, free'd blocks are reused by the next allocation of the same class
+ When out of memory (or the block is bigger than the largest class), falls back onto GlobalAllocator
+ Reallocations stay in place when the class doesn't change, when the block is the last one carved
+ from the pool (the bump pointer just moves), or when shrinking (the tail goes back to the free lists)
+ 
+ Growable mode (ArenaAllocator(firstChunkSize, hardCap)):
+ Instead of falling back onto GlobalAllocator, chains extra chunks mapped from the OS, each twice the size of the last.
+ Blocks bigger than the largest class get their own mapping. Nothing ever comes from the C heap.
+ Once the mapped bytes would go over the hard cap Allocate returns nullptr, which makes lua raise a memory error.
+ Shrinking never maps anything, so it can't fail at the cap (lua expects shrinks to always succeed).
  
  Memory alignment concerns:
  - Multi-threading safety
@@ -100,6 +254,7 @@ struct GlobalAllocator
 struct ArenaAllocator
     : public IAllocator<ArenaAllocator>
 {
+    // Current chunk (the whole pool in fixed mode)
     void* m_begin;
     void* m_end;
     
@@ -109,99 +264,417 @@ struct ArenaAllocator
     // For this ArenaAllocator, we will always align to 8 byte boundries
     static constexpr int ALIGNMENT = 8;
     
-    // Minimum size to allocate
-    static constexpr int MIN_BLOCK_SIZE = ALIGNMENT * 8;
+    // Minimum size to allocate (smallest size class, big enough to hold a FreeList link)
+    static constexpr int MIN_BLOCK_SIZE = ALIGNMENT * 2;
+    
+    // Small classes are MIN_BLOCK_SIZE apart: 16, 32, 48 ... 128
+    static constexpr int NUM_SMALL_CLASSES = 8;
+    static constexpr int SMALL_CLASS_LIMIT_LOG2 = 7;
+    static constexpr size_t SMALL_CLASS_LIMIT = size_t(1) << SMALL_CLASS_LIMIT_LOG2;
+    
+    // Above that, each power of two is split into 4 classes: 160, 192, 224, 256, 320 ... (jemalloc style)
+    static constexpr int CLASSES_PER_DOUBLING_LOG2 = 2;
+    static constexpr int CLASSES_PER_DOUBLING = 1 << CLASSES_PER_DOUBLING_LOG2;
+    
+    // Largest size class, anything bigger always comes from the global allocator (or its own mapping when growable)
+    static constexpr int MAX_CLASS_SIZE_LOG2 = 16;
+    static constexpr size_t MAX_CLASS_SIZE = size_t(1) << MAX_CLASS_SIZE_LOG2;
+    
+    static constexpr int NUM_SIZE_CLASSES = NUM_SMALL_CLASSES + (MAX_CLASS_SIZE_LOG2 - SMALL_CLASS_LIMIT_LOG2) * CLASSES_PER_DOUBLING;
     
-    // Linkedlist of free memory blocks (MIN_BLOCK_SIZE)
+    // Linkedlist of free memory blocks (one per size class)
     struct FreeList
     {
         FreeList* m_next;
     };
     
-    FreeList* m_freeListHead;
+    // Header at the start of every mapped chunk (growable mode)
+    struct Chunk
+    {
+        Chunk* m_next;
+        size_t m_size;
+    };
+    
+    FreeList* m_freeLists[NUM_SIZE_CLASSES];
     GlobalAllocator m_globalAllocator;
     
+    ReAllocCounters m_reallocCounters;
+    ArenaCounters m_counters;
+    
+    // Growable mode
+    bool m_growable;
+    Chunk* m_chunks;            // Most recent chunk first, the first chunk is last
+    size_t m_firstChunkSize;
+    size_t m_nextChunkSize;
+    size_t m_mappedBytes;       // Chunks + mappings of blocks bigger than MAX_CLASS_SIZE
+    size_t m_hardCap;
+    
     // accept begining and ending pointers of arena
     ArenaAllocator(void* begin, void* end)
     : m_begin(begin),
-    m_end(end)
+    m_end(end),
+    m_growable(false),
+    m_chunks(nullptr),
+    m_firstChunkSize(0),
+    m_nextChunkSize(0),
+    m_mappedBytes(0),
+    m_hardCap(0)
     {
         Reset();
     }
     
+    // Growable mode: starts with one chunk of firstChunkSize, never maps more than hardCapBytes in total
+    ArenaAllocator(size_t firstChunkSize, size_t hardCapBytes)
+    : m_begin(nullptr),
+    m_end(nullptr),
+    m_growable(true),
+    m_chunks(nullptr),
+    m_firstChunkSize(PageAllocator::RoundUpToPage(firstChunkSize)),
+    m_nextChunkSize(0),
+    m_mappedBytes(0),
+    m_hardCap(hardCapBytes)
+    {
+        Reset();
+    }
+    
+    ArenaAllocator(const ArenaAllocator&) = delete;
+    ArenaAllocator& operator=(const ArenaAllocator&) = delete;
+    
+    ~ArenaAllocator()
+    {
+        while (m_chunks)
+        {
+            Chunk* next = m_chunks->m_next;
+            PageAllocator::Unmap(m_chunks, m_chunks->m_size);
+            m_chunks = next;
+        }
+    }
+    
+    // Growable mode keeps (or maps) only the first chunk
     void Reset()
     {
-        m_freeListHead = nullptr;
+        for (FreeList*& head : m_freeLists)
+        {
+            head = nullptr;
+        }
+        
+        if (m_growable)
+        {
+            while (m_chunks && m_chunks->m_next)
+            {
+                Chunk* next = m_chunks->m_next;
+                m_mappedBytes -= m_chunks->m_size;
+                PageAllocator::Unmap(m_chunks, m_chunks->m_size);
+                m_chunks = next;
+            }
+            
+            m_nextChunkSize = m_firstChunkSize;
+            if (m_chunks == nullptr && !AddChunk(0))
+            {
+                m_begin = m_end = m_curr = nullptr;
+                return;
+            }
+            UseChunk(m_chunks);
+            m_nextChunkSize = m_firstChunkSize * 2;
+            return;
+        }
+        
         m_curr = static_cast<char*>(m_begin);
     }
     
+    // Bookkeeping needed to put a fixed pool back exactly as it was (see StatePool).
+    // The blocks themselves (and the free list links inside them) are copied by the caller
+    struct Snapshot
+    {
+        char* m_curr;
+        FreeList* m_freeLists[NUM_SIZE_CLASSES];
+    };
+    
+    Snapshot TakeSnapshot() const
+    {
+        assert(!m_growable); // Only the fixed pool stays at one address range
+        Snapshot snapshot;
+        snapshot.m_curr = m_curr;
+        memcpy(snapshot.m_freeLists, m_freeLists, sizeof(m_freeLists));
+        return snapshot;
+    }
+    
+    void RestoreSnapshot(const Snapshot& snapshot)
+    {
+        m_curr = snapshot.m_curr;
+        memcpy(m_freeLists, snapshot.m_freeLists, sizeof(m_freeLists));
+    }
+    
+    // Index of the highest set bit (v must not be 0)
+    static int FloorLog2(size_t v)
+    {
+#if defined(_MSC_VER) && defined(_WIN64)
+        unsigned long index;
+        _BitScanReverse64(&index, v);
+        return (int) index;
+#elif defined(_MSC_VER)
+        unsigned long index;
+        _BitScanReverse(&index, (unsigned long) v);
+        return (int) index;
+#else
+        return (int) (sizeof(unsigned long long) * 8 - 1) - __builtin_clzll((unsigned long long) v);
+#endif
+    }
+    
+    // Maps a size (<= MAX_CLASS_SIZE) to its size class index in O(1)
+    static int SizeClass(size_t size)
+    {
+        if (size <= SMALL_CLASS_LIMIT)
+        {
+            return size <= MIN_BLOCK_SIZE ? 0 : (int) ((size - 1) / MIN_BLOCK_SIZE);
+        }
+        
+        int log2 = FloorLog2(size - 1);
+        int shift = log2 - CLASSES_PER_DOUBLING_LOG2;
+        int classInDoubling = (int) ((size - 1) >> shift) - CLASSES_PER_DOUBLING;
+        return NUM_SMALL_CLASSES + (log2 - SMALL_CLASS_LIMIT_LOG2) * CLASSES_PER_DOUBLING + classInDoubling;
+    }
+    
+    // Size of the blocks handed out for a size class
+    static size_t ClassSize(int sizeClass)
+    {
+        if (sizeClass < NUM_SMALL_CLASSES)
+        {
+            return (size_t) (sizeClass + 1) * MIN_BLOCK_SIZE;
+        }
+        
+        int k = sizeClass - NUM_SMALL_CLASSES;
+        int log2 = SMALL_CLASS_LIMIT_LOG2 + k / CLASSES_PER_DOUBLING;
+        return (size_t) (CLASSES_PER_DOUBLING + k % CLASSES_PER_DOUBLING + 1) << (log2 - CLASSES_PER_DOUBLING_LOG2);
+    }
+    
     size_t SizeToAllocate(size_t size)
     {
-        size_t allocatedSize = size;
-        if (allocatedSize < MIN_BLOCK_SIZE)
+        return ClassSize(SizeClass(size));
+    }
+    
+    // Would mapping sizeBytes more stay under the hard cap
+    bool CanMap(size_t sizeBytes) const
+    {
+        return sizeBytes <= m_hardCap && m_mappedBytes <= m_hardCap - sizeBytes;
+    }
+    
+    // Starts carving from a chunk
+    void UseChunk(Chunk* chunk)
+    {
+        m_begin = reinterpret_cast<char*>(chunk) + sizeof(Chunk);
+        m_end = reinterpret_cast<char*>(chunk) + chunk->m_size;
+        m_curr = static_cast<char*>(m_begin);
+    }
+    
+    // Maps a new chunk with room for at least minBytes, each chunk is twice the size of the previous one
+    bool AddChunk(size_t minBytes)
+    {
+        size_t chunkSize = m_nextChunkSize;
+        size_t needed = PageAllocator::RoundUpToPage(minBytes + sizeof(Chunk));
+        if (chunkSize < needed)
+        {
+            chunkSize = needed;
+        }
+        
+        // Near the cap: settle for whatever is left, as long as it fits the block
+        if (!CanMap(chunkSize))
+        {
+            chunkSize = (m_hardCap - m_mappedBytes) & ~(PageAllocator::PAGE_SIZE - 1);
+            if (m_mappedBytes > m_hardCap || chunkSize < needed)
+            {
+                return false;
+            }
+        }
+        
+        Chunk* chunk = static_cast<Chunk*>(PageAllocator::Map(chunkSize));
+        if (chunk == nullptr)
+        {
+            return false;
+        }
+        
+        chunk->m_size = chunkSize;
+        chunk->m_next = m_chunks;
+        m_chunks = chunk;
+        m_mappedBytes += chunkSize;
+        m_nextChunkSize = chunkSize * 2;
+        return true;
+    }
+    
+    // Carves from the current chunk, nullptr when it is full
+    void* Carve(size_t allocatedBytes)
+    {
+        // Alignes up to the next 8 byte boundry
+        m_curr = (char*) ( ((uintptr_t) m_curr + (ALIGNMENT - 1)) & ~(uintptr_t) (ALIGNMENT - 1) );
+        
+        if (m_curr <= static_cast<char*>(m_end) && allocatedBytes <= (size_t) (static_cast<char*>(m_end) - m_curr))
+        {
+            //printf("Allocated %d bytes\n", (int) allocatedBytes);
+            void* ptr = m_curr;
+            m_curr += allocatedBytes;
+            return ptr;
+        }
+        return nullptr;
+    }
+    
+    // Growable mode: blocks bigger than MAX_CLASS_SIZE get their own mapping
+    void* MapLargeBlock(size_t sizeBytes)
+    {
+        size_t mappedBytes = PageAllocator::RoundUpToPage(sizeBytes);
+        if (!CanMap(mappedBytes))
+        {
+            return nullptr;
+        }
+        
+        void* ptr = PageAllocator::Map(mappedBytes);
+        if (ptr)
         {
-            allocatedSize = MIN_BLOCK_SIZE;
+            m_mappedBytes += mappedBytes;
         }
-        return allocatedSize;
+        return ptr;
+    }
+    
+    void UnmapLargeBlock(void* ptr, size_t sizeBytes)
+    {
+        size_t mappedBytes = PageAllocator::RoundUpToPage(sizeBytes);
+        PageAllocator::Unmap(ptr, mappedBytes);
+        m_mappedBytes -= mappedBytes;
+    }
+    
+    // A block with its own mapping shrinking into a size class when no chunk has room (at the hard cap):
+    // its mapping becomes a chunk. The data moves up past the chunk header, the rest goes onto the free lists.
+    // Nothing new is mapped
+    void* MappingToChunk(void* ptr, size_t osize, size_t nsize)
+    {
+        size_t mappedBytes = PageAllocator::RoundUpToPage(osize);
+        char* block = static_cast<char*>(ptr) + sizeof(Chunk);
+        memmove(block, ptr, nsize);
+        
+        // Unmapped by Reset and the destructor like any other chunk
+        Chunk* chunk = static_cast<Chunk*>(ptr);
+        chunk->m_size = mappedBytes;
+        chunk->m_next = m_chunks;
+        m_chunks = chunk;
+        
+        size_t blockBytes = SizeToAllocate(nsize);
+        ReleaseRange(block + blockBytes, (mappedBytes - sizeof(Chunk) - blockBytes) & ~(size_t) (MIN_BLOCK_SIZE - 1));
+        return block;
     }
     
     // Allocates section of memory
     void* Allocate(size_t sizeBytes) override
     {
-        size_t allocatedBytes = SizeToAllocate(sizeBytes);
+        // Too big for any size class
+        if (sizeBytes > MAX_CLASS_SIZE)
+        {
+            if (m_growable)
+            {
+                return MapLargeBlock(sizeBytes);
+            }
+            m_counters.m_fallbacks++;
+            return m_globalAllocator.Allocate(sizeBytes);
+        }
         
-        // Allocate memory from free list
-        if (allocatedBytes <= MIN_BLOCK_SIZE && m_freeListHead)
+        int sizeClass = SizeClass(sizeBytes);
+        
+        // Allocate memory from the free list of this size class
+        if (FreeList* block = m_freeLists[sizeClass])
         {
             //printf("-- allocated from the freelist --\n");
-            void* ptr = m_freeListHead;
-            m_freeListHead = m_freeListHead->m_next;
-            return ptr;
+            m_freeLists[sizeClass] = block->m_next;
+            m_counters.m_freeListHits++;
+            return block;
         }
+        m_counters.m_freeListMisses++;
         
         // Allocate memory from pool
-        else
+        size_t allocatedBytes = ClassSize(sizeClass);
+        if (void* ptr = Carve(allocatedBytes))
         {
-            // Alignes up to the next 8 byte boundry
-            m_curr = (char*) ( ((uintptr_t) m_curr + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1) );
-            
-            // Out of memory
-            if ((m_curr + allocatedBytes) <= m_end)
+            m_counters.m_carved++;
+            return ptr;
+        }
+        
+        // Out of memory? Chain a new chunk, the rest of the current one goes onto the free lists
+        if (m_growable)
+        {
+            char* tail = m_curr;
+            size_t tailBytes = m_curr < static_cast<char*>(m_end) ? (size_t) (static_cast<char*>(m_end) - m_curr) : 0;
+            if (!AddChunk(allocatedBytes))
             {
-                
-                //printf("Allocated %d bytes\n", (int) allocatedBytes);
-                void* ptr = m_curr;
-                m_curr += allocatedBytes;
-                
-                return ptr;
+                return nullptr;
             }
-            
-            // Out of memory? Fallback on global allocator
-            else
+            ReleaseRange(tail, tailBytes & ~(size_t) (MIN_BLOCK_SIZE - 1));
+            UseChunk(m_chunks);
+            m_counters.m_carved++;
+            return Carve(allocatedBytes);
+        }
+        
+        // Out of memory? Fallback on global allocator
+        m_counters.m_fallbacks++;
+        return m_globalAllocator.Allocate(sizeBytes);
+    }
+    
+    // Was the block carved from the pool (any chunk), rather than the global allocator or its own mapping
+    bool OwnsBlock(void* ptr, size_t sizeBytes) const
+    {
+        if (m_growable)
+        {
+            return sizeBytes <= MAX_CLASS_SIZE;
+        }
+        return ptr >= m_begin && ptr < m_end;
+    }
+    
+    void PushFreeBlock(void* ptr, int sizeClass)
+    {
+        FreeList* newHead = static_cast<FreeList*>(ptr);
+        newHead->m_next = m_freeLists[sizeClass];
+        m_freeLists[sizeClass] = newHead;
+    }
+    
+    // Gives a range of pool memory (multiple of MIN_BLOCK_SIZE) back to the free lists, largest classes first
+    void ReleaseRange(char* ptr, size_t bytes)
+    {
+        while (bytes >= MIN_BLOCK_SIZE)
+        {
+            int sizeClass = SizeClass(bytes < MAX_CLASS_SIZE ? bytes : MAX_CLASS_SIZE);
+            if (ClassSize(sizeClass) > bytes)
             {
-                return m_globalAllocator.Allocate(sizeBytes);
+                sizeClass--;
             }
-        
+            PushFreeBlock(ptr, sizeClass);
+            ptr += ClassSize(sizeClass);
+            bytes -= ClassSize(sizeClass);
         }
     }
     
     void DeAllocate(void* ptr, size_t osize) override
     {
-        size_t allocatedBytes = SizeToAllocate(osize);
         assert(ptr != nullptr); // Ensure we are not deallocating a nullptr
         
         // Dellocate from pool
-        if (ptr >= m_begin && ptr <= m_end)
+        if (OwnsBlock(ptr, osize))
         {
-            if (allocatedBytes >= MIN_BLOCK_SIZE)
+            int sizeClass = SizeClass(osize);
+            
+            // Last block carved from the pool: coalesce with the free space after it
+            if (static_cast<char*>(ptr) + ClassSize(sizeClass) == m_curr)
+            {
+                m_curr = static_cast<char*>(ptr);
+            }
+            else
             {
                 //printf("-- deallocated to the freelist --\n");
-                FreeList* newHead = static_cast<FreeList*>(ptr);
-                newHead->m_next = m_freeListHead;
-                m_freeListHead = newHead;
+                PushFreeBlock(ptr, sizeClass);
             }
         }
         
+        // Block had its own mapping
+        else if (m_growable)
+        {
+            UnmapLargeBlock(ptr, osize);
+        }
+        
         // Dellocate memory from global
         else
         {
@@ -217,9 +690,98 @@ struct ArenaAllocator
         {
             bytesToCopy = nsize;
         }
-        void* newPtr = Allocate(nsize);
+        
+        if (OwnsBlock(ptr, osize) && nsize <= MAX_CLASS_SIZE)
+        {
+            char* block = static_cast<char*>(ptr);
+            size_t oldBytes = SizeToAllocate(osize);
+            size_t newBytes = SizeToAllocate(nsize);
+            
+            // Same size class, the block already fits
+            if (newBytes == oldBytes)
+            {
+                m_reallocCounters.m_inPlace++;
+                return ptr;
+            }
+            
+            // Last block carved from the pool: just move the bump pointer (if the pool has room)
+            if (block + oldBytes == m_curr)
+            {
+                if (newBytes <= (size_t) (static_cast<char*>(m_end) - block))
+                {
+                    m_curr = block + newBytes;
+                    m_reallocCounters.m_inPlace++;
+                    return ptr;
+                }
+            }
+            
+            // Shrinking: keep the block where it is, the tail goes back onto the free lists
+            else if (newBytes < oldBytes)
+            {
+                ReleaseRange(block + newBytes, oldBytes - newBytes);
+                m_reallocCounters.m_inPlace++;
+                return ptr;
+            }
+        }
+        
+        // Both sizes too big for the pool
+        else if (!OwnsBlock(ptr, osize) && nsize > MAX_CLASS_SIZE)
+        {
+            // Own mapping: still the same number of pages, or shrinking (the tail pages are unmapped)
+            if (m_growable)
+            {
+                size_t oldMapped = PageAllocator::RoundUpToPage(osize);
+                size_t newMapped = PageAllocator::RoundUpToPage(nsize);
+                if (newMapped <= oldMapped)
+                {
+                    if (newMapped < oldMapped)
+                    {
+                        PageAllocator::UnmapTail(ptr, oldMapped, newMapped);
+                        m_mappedBytes -= oldMapped - newMapped;
+                    }
+                    m_reallocCounters.m_inPlace++;
+                    return ptr;
+                }
+            }
+            
+            // Global memory: let realloc try to grow it in place
+            else
+            {
+                uintptr_t oldAddress = (uintptr_t) ptr;
+                void* newPtr = m_globalAllocator.ReAllocate(ptr, osize, nsize);
+                if (newPtr == nullptr)
+                {
+                    return nullptr;
+                }
+                
+                m_reallocCounters.Record((uintptr_t) newPtr == oldAddress, bytesToCopy);
+                return newPtr;
+            }
+        }
+        
+        // Qualified calls: no vtable lookup when called through StaticAllocator
+        void* newPtr = ArenaAllocator::Allocate(nsize);
+        
+        // Lua expects a shrink to never fail. Only two shrinks get here (every other one stayed in place above):
+        // a global block shrinking into a size class (it still fits, keep it), and a block with its own mapping
+        // shrinking into a size class (turn the mapping into a chunk, staying under the hard cap)
+        if (newPtr == nullptr && nsize <= osize)
+        {
+            if (!m_growable)
+            {
+                return ptr;
+            }
+            m_reallocCounters.Record(false, nsize);
+            return MappingToChunk(ptr, osize, nsize);
+        }
+        
+        if (newPtr == nullptr)
+        {
+            return nullptr;
+        }
         memcpy(newPtr, ptr, bytesToCopy);
-        DeAllocate(ptr, osize);
+        ArenaAllocator::DeAllocate(ptr, osize);
+        m_reallocCounters.Record(false, bytesToCopy);
         return newPtr;
     }
     
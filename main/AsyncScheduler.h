@@ -0,0 +1,412 @@
+#pragma once
+
+#include "lua.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+ Async natives: a single thread running thousands of script coroutines ("tasks") over an event loop.
+
+ An async native starts its operation and goes pending: the calling coroutine yields (lua_yieldk) back to
+ the loop. When the operation completes (Complete / Fail), the loop resumes the coroutine and the
+ continuation returns the results to the script, or raises the error right at the call site (so pcall works).
+ To the script it looks like an ordinary blocking call.
+
+ Async natives only work inside tasks started with Spawn (or Async.Spawn from lua), a plain coroutine.yield
+ in a task just hands the thread to the next task.
+ Completions come from the loop's own thread (timers here), Complete/Fail are not thread safe.
+
+ Built in stand-ins for testing: Async.Sleep(ms), Async.ReadFile(path) (a read with simulated latency).
+
+ static void StartQuery(lua_State* L, AsyncScheduler& scheduler, AsyncScheduler::OpId op)
+ {
+     // Check the arguments first, then start the operation, which eventually calls
+     scheduler.Complete(op, [](lua_State* L) { lua_pushinteger(L, 42); return 1; });
+ }
+ static const AsyncScheduler::AsyncFunction functions[] = { { "Query", StartQuery } };
+ scheduler.Bind(L, "Database", functions, 1);
+ */
+struct AsyncScheduler
+{
+    typedef uint64_t OpId;
+    typedef std::chrono::steady_clock Clock;
+
+    // Pushes the results onto the coroutine, returns how many
+    typedef std::function<int(lua_State* L)> PushResults;
+
+    // Reads the arguments (1..top of L) and starts the operation, which must end with Complete or Fail
+    typedef void (*StartFunction)(lua_State* L, AsyncScheduler& scheduler, OpId op);
+
+    struct AsyncFunction
+    {
+        const char* m_name;
+        StartFunction m_start;
+    };
+
+    struct Task
+    {
+        int m_ref;                      // Keeps the coroutine alive
+        OpId m_waitingOn;               // 0: not in an async native
+        OpId m_startingOp;              // Op whose start function is running, still set if it raised an error
+    };
+
+    struct Ready
+    {
+        lua_State* m_thread;
+        OpId m_op;                      // Completed op, 0 for a start or plain yield
+        int m_numArgs;                  // Already on the coroutine's stack (start, plain yield)
+        bool m_completion;              // Resumes an async native
+        bool m_ok;
+        PushResults m_push;
+        std::string m_error;
+    };
+
+    struct Timer
+    {
+        Clock::time_point m_due;
+        uint64_t m_sequence;            // Same due time: first added fires first
+        std::function<void()> m_fire;
+
+        bool operator>(const Timer& other) const
+        {
+            return m_due != other.m_due ? m_due > other.m_due : m_sequence > other.m_sequence;
+        }
+    };
+
+    lua_State* m_state;
+    std::unordered_map<lua_State*, Task> m_tasks;
+    std::unordered_map<OpId, lua_State*> m_pendingOps;
+    std::deque<Ready> m_ready;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> m_timers;
+    OpId m_nextOp;
+    uint64_t m_nextTimer;
+    int m_ioLatencyMs;                  // Of the ReadFile stand-in
+
+    // Stats
+    size_t m_resumes;
+    size_t m_tasksFinished;
+    size_t m_tasksFailed;
+    size_t m_maxTasks;
+
+    AsyncScheduler(lua_State* L)
+    : m_state(L),
+    m_nextOp(1),
+    m_nextTimer(0),
+    m_ioLatencyMs(2),
+    m_resumes(0),
+    m_tasksFinished(0),
+    m_tasksFailed(0),
+    m_maxTasks(0)
+    { }
+
+    // Call before lua_close. Unfinished tasks are dropped, their coroutines collected with the state
+    void Shutdown()
+    {
+        if (m_state == nullptr)
+        {
+            return;
+        }
+        for (auto& task : m_tasks)
+        {
+            luaL_unref(m_state, LUA_REGISTRYINDEX, task.second.m_ref);
+        }
+        m_tasks.clear();
+        m_pendingOps.clear();
+        m_ready.clear();
+        m_timers = decltype(m_timers)();
+        m_state = nullptr;
+    }
+
+    // Nothing to release once Shutdown ran (the state may be closed by now)
+    ~AsyncScheduler()
+    {
+        Shutdown();
+    }
+
+    AsyncScheduler(const AsyncScheduler&) = delete;
+    AsyncScheduler& operator=(const AsyncScheduler&) = delete;
+
+    // The function and its nargs arguments are on top of L's stack (like lua_pcall), they are moved to a new task.
+    // It first runs on the next loop iteration
+    void Spawn(lua_State* L, int nargs)
+    {
+        lua_State* thread = lua_newthread(L);
+        Task task = { luaL_ref(L, LUA_REGISTRYINDEX), 0, 0 };
+        lua_xmove(L, thread, nargs + 1);
+        m_tasks[thread] = task;
+        m_maxTasks = m_tasks.size() > m_maxTasks ? m_tasks.size() : m_maxTasks;
+
+        Ready ready = { thread, 0, nargs, false, true, nullptr, std::string() };
+        m_ready.push_back(std::move(ready));
+    }
+
+    void AddTimer(int delayMs, std::function<void()> fire)
+    {
+        Timer timer = { Clock::now() + std::chrono::milliseconds(delayMs), m_nextTimer++, std::move(fire) };
+        m_timers.push(std::move(timer));
+    }
+
+    // The async native's results. Unknown ops (their task died meanwhile) are ignored
+    void Complete(OpId op, PushResults push)
+    {
+        auto pending = m_pendingOps.find(op);
+        if (pending != m_pendingOps.end())
+        {
+            Ready ready = { pending->second, op, 0, true, true, std::move(push), std::string() };
+            m_ready.push_back(std::move(ready));
+            m_pendingOps.erase(pending);
+        }
+    }
+
+    // Raises the error in the script, at the async native's call
+    void Fail(OpId op, std::string error)
+    {
+        auto pending = m_pendingOps.find(op);
+        if (pending != m_pendingOps.end())
+        {
+            Ready ready = { pending->second, op, 0, true, false, nullptr, std::move(error) };
+            m_ready.push_back(std::move(ready));
+            m_pendingOps.erase(pending);
+        }
+    }
+
+    void Finish(lua_State* thread)
+    {
+        auto task = m_tasks.find(thread);
+        m_pendingOps.erase(task->second.m_waitingOn);
+        m_pendingOps.erase(task->second.m_startingOp);
+        luaL_unref(m_state, LUA_REGISTRYINDEX, task->second.m_ref);
+        m_tasks.erase(task);
+    }
+
+    void Resume(Ready& ready)
+    {
+        lua_State* thread = ready.m_thread;
+        auto found = m_tasks.find(thread);
+
+        // Completed while its start function was running, then the start raised an error: the task isn't waiting on it
+        if (ready.m_completion && (found == m_tasks.end() || found->second.m_waitingOn != ready.m_op))
+        {
+            return;
+        }
+        Task& task = found->second;     // Stays valid when other tasks are spawned
+
+        int numArgs = ready.m_numArgs;
+        if (ready.m_completion)
+        {
+            // Picked up by Continue()
+            lua_pushboolean(thread, ready.m_ok);
+            if (ready.m_ok)
+            {
+                numArgs = 1 + (ready.m_push ? ready.m_push(thread) : 0);
+            }
+            else
+            {
+                lua_pushlstring(thread, ready.m_error.data(), ready.m_error.size());
+                numArgs = 2;
+            }
+        }
+
+        task.m_waitingOn = 0;
+        m_resumes++;
+        int status = lua_resume(thread, m_state, numArgs);
+
+        // An async start raised an error the script caught (pcall(Async.Sleep, "x")): drop its op
+        if (task.m_startingOp)
+        {
+            m_pendingOps.erase(task.m_startingOp);
+            task.m_startingOp = 0;
+        }
+
+        if (status == LUA_YIELD)
+        {
+            if (task.m_waitingOn == 0)
+            {
+                // Plain coroutine.yield: back of the queue
+                lua_settop(thread, 0);
+                Ready next = { thread, 0, 0, false, true, nullptr, std::string() };
+                m_ready.push_back(std::move(next));
+            }
+            return;
+        }
+
+        if (status != LUA_OK)
+        {
+            const char* error = lua_tostring(thread, -1);
+            printf("Task error: %s\n", error ? error : "(error object is not a string)");
+            m_tasksFailed++;
+        }
+        m_tasksFinished++;
+        Finish(thread);
+    }
+
+    // Fires the due timers, then resumes every task that was ready. Returns false when no task can make progress
+    bool RunOnce()
+    {
+        Clock::time_point now = Clock::now();
+        while (!m_timers.empty() && m_timers.top().m_due <= now)
+        {
+            std::function<void()> fire = m_timers.top().m_fire;
+            m_timers.pop();
+            fire();
+        }
+
+        // Tasks made ready while resuming wait for the next iteration
+        std::deque<Ready> ready;
+        ready.swap(m_ready);
+        for (Ready& entry : ready)
+        {
+            Resume(entry);
+        }
+        return !m_ready.empty() || !m_timers.empty();
+    }
+
+    // Runs until every task finished (or waits on something that will never complete)
+    void Run()
+    {
+        while (RunOnce())
+        {
+            if (m_ready.empty() && !m_timers.empty())
+            {
+                std::this_thread::sleep_until(m_timers.top().m_due);
+            }
+        }
+    }
+
+    // ---- Binding ----
+
+    // Continuation of an async native: 1..ctx its arguments, then what Resume() pushed
+    static int Continue(lua_State* L, int /*status*/, lua_KContext ctx)
+    {
+        int okIdx = (int) ctx + 1;
+        if (!lua_toboolean(L, okIdx))
+        {
+            lua_pushvalue(L, okIdx + 1);
+            return lua_error(L);
+        }
+        return lua_gettop(L) - okIdx;
+    }
+
+    // Up-values: 1 scheduler, 2 AsyncFunction
+    static int Dispatch(lua_State* L)
+    {
+        AsyncScheduler& scheduler = *(AsyncScheduler*) lua_touserdata(L, lua_upvalueindex(1));
+        const AsyncFunction& function = *(const AsyncFunction*) lua_touserdata(L, lua_upvalueindex(2));
+
+        auto task = scheduler.m_tasks.find(L);
+        if (task == scheduler.m_tasks.end() || !lua_isyieldable(L))
+        {
+            return luaL_error(L, "async function '%s' called outside of an async task", function.m_name);
+        }
+
+        Task& waiting = task->second;   // The iterator wouldn't survive a start that spawns tasks
+
+        // Left over by an earlier start that raised an error
+        if (waiting.m_startingOp)
+        {
+            scheduler.m_pendingOps.erase(waiting.m_startingOp);
+        }
+
+        // Pending before starting: the operation may complete right away. If start raises an error,
+        // m_startingOp stays set and Resume() (or Finish()) drops the op
+        OpId op = scheduler.m_nextOp++;
+        scheduler.m_pendingOps[op] = L;
+        waiting.m_startingOp = op;
+        function.m_start(L, scheduler, op);
+
+        // Started: only now is the task waiting on it
+        waiting.m_startingOp = 0;
+        waiting.m_waitingOn = op;
+        return lua_yieldk(L, 0, (lua_KContext) lua_gettop(L), Continue);
+    }
+
+    // Async.Spawn(function, ...)
+    static int SpawnFromLua(lua_State* L)
+    {
+        AsyncScheduler& scheduler = *(AsyncScheduler*) lua_touserdata(L, lua_upvalueindex(1));
+        luaL_checktype(L, 1, LUA_TFUNCTION);
+        scheduler.Spawn(L, lua_gettop(L) - 1);
+        return 0;
+    }
+
+    // Sets the functions on the global table tableName (created if needed). functions must outlive the state
+    void Bind(lua_State* L, const char* tableName, const AsyncFunction* functions, int numFunctions)
+    {
+        if (lua_getglobal(L, tableName) != LUA_TTABLE)
+        {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_setglobal(L, tableName);
+        }
+        for (int i = 0; i < numFunctions; i++)
+        {
+            lua_pushlightuserdata(L, this);
+            lua_pushlightuserdata(L, (void*) &functions[i]);
+            lua_pushcclosure(L, Dispatch, 2);
+            lua_setfield(L, -2, functions[i].m_name);
+        }
+        lua_pop(L, 1);
+    }
+
+    // ---- Stand-ins ----
+
+    static void StartSleep(lua_State* L, AsyncScheduler& scheduler, OpId op)
+    {
+        int delayMs = (int) luaL_checkinteger(L, 1);
+        scheduler.AddTimer(delayMs, [&scheduler, op]() { scheduler.Complete(op, nullptr); });
+    }
+
+    // Reads the whole file once the latency passed
+    static void StartReadFile(lua_State* L, AsyncScheduler& scheduler, OpId op)
+    {
+        std::string path = luaL_checkstring(L, 1);
+        scheduler.AddTimer(scheduler.m_ioLatencyMs, [&scheduler, op, path]()
+        {
+            FILE* file = fopen(path.c_str(), "rb");
+            if (file == nullptr)
+            {
+                scheduler.Fail(op, "can't open '" + path + "'");
+                return;
+            }
+            std::string contents;
+            char buffer[4096];
+            size_t bytesRead;
+            while ((bytesRead = fread(buffer, 1, sizeof(buffer), file)) > 0)
+            {
+                contents.append(buffer, bytesRead);
+            }
+            fclose(file);
+            scheduler.Complete(op, [contents](lua_State* L)
+            {
+                lua_pushlstring(L, contents.data(), contents.size());
+                return 1;
+            });
+        });
+    }
+
+    // Async.Sleep, Async.ReadFile and Async.Spawn
+    void BindStandIns(lua_State* L)
+    {
+        static const AsyncFunction functions[] =
+        {
+            { "Sleep", StartSleep },
+            { "ReadFile", StartReadFile },
+        };
+        Bind(L, "Async", functions, 2);
+
+        lua_getglobal(L, "Async");
+        lua_pushlightuserdata(L, this);
+        lua_pushcclosure(L, SpawnFromLua, 1);
+        lua_setfield(L, -2, "Spawn");
+        lua_pop(L, 1);
+    }
+};
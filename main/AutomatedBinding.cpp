@@ -1,8 +1,13 @@
 
 #include "ArenaAllocator.h"
 #include "AutomatedBinding.h"
+#include "BindingTrace.h"
+#include "DirectBinding.h"
+#include "LuaString.h"
+#include "UserDatum.h"
 #include "lua.hpp"
 #include <string.h>
+#include <chrono>
 #include <cstdio>
 #include <rttr/registration>
 
@@ -18,6 +23,13 @@ Global.HelloWorld()
 Global.HelloWorld2()
 local c = Global.Mul(42, 43)
 Global.Test(c, 22, 10)
+
+-- bound class: methods, properties, and extra values kept in the user value
+local sprite = Sprite.new()
+sprite:Move(3, 4)
+sprite.x = sprite.x + 10
+sprite.name = "hero"
+sprite:Draw()
 )";
 
 
@@ -40,110 +52,408 @@ void doSomething(PassByValue& a, lua_Number b)
     selectMember<T>(a) = (T) b;
 }
 
-int CallGlobalFromLua(lua_State* L)
+// Reads a lua argument into storage (which must outlive the call) and returns the rttr argument referencing it
+typedef rttr::argument (*ArgConverter)(lua_State* L, int luaArgIdx, PassByValue& storage);
+
+// Pushes the native return value, returns the number of values pushed
+typedef int (*ReturnConverter)(lua_State* L, const rttr::variant& result);
+
+template <typename T>
+rttr::argument NumberArg(lua_State* L, int luaArgIdx, PassByValue& storage)
 {
-    // Grab type information from up-value
-    rttr::method* m = (rttr::method*) lua_touserdata(L, lua_upvalueindex(1));
+    doSomething<T>(storage, luaL_checknumber(L, luaArgIdx));
+    return rttr::argument(selectMember<T>(storage));
+}
+
+rttr::argument UnhandledArg(lua_State* L, int luaArgIdx, PassByValue& /*storage*/)
+{
+    luaL_error(L, "Unrecognised parameter type for argument %d", luaArgIdx);
+    return rttr::argument();
+}
+
+template <typename T>
+int NumberResult(lua_State* L, const rttr::variant& result)
+{
+    lua_pushnumber(L, result.get_value<T>());
+    return 1;
+}
+
+int VoidResult(lua_State* /*L*/, const rttr::variant& /*result*/)
+{
+    return 0;
+}
+
+int UnhandledResult(lua_State* L, const rttr::variant& result)
+{
+    return luaL_error(L, "Unhandled return type '%s'\n", PushString(L, result.get_type().get_name()));
+}
+
+ArgConverter ArgConverterFor(const rttr::type& t)
+{
+    if (t == rttr::type::get<int>())
+    {
+        return NumberArg<int>;
+    }
+    else if (t == rttr::type::get<short>())
+    {
+        return NumberArg<short>;
+    }
+    StringView name = t.get_name();
+    printf("Unrecognised parameter type '%.*s'\n", (int) name.size(), name.data());
+    return UnhandledArg;
+}
+
+ReturnConverter ReturnConverterFor(const rttr::type& t)
+{
+    if (t == rttr::type::get<void>())
+    {
+        return VoidResult;
+    }
+    else if (t == rttr::type::get<int>())
+    {
+        return NumberResult<int>;
+    }
+    else if (t == rttr::type::get<short>())
+    {
+        return NumberResult<short>;
+    }
+    return UnhandledResult;
+}
+
+// Everything CallGlobalFromLua needs, resolved once at binding time. Lives in a full userdata upvalue
+struct MethodDispatch
+{
+    // rttr::method::invoke takes up to 6 arguments without building a std::vector
+    static constexpr int MAX_ARGS = 6;
     
-    // Invoke method
-    rttr::method& methodToInvoke(*m);
-    rttr::array_range<rttr::parameter_info> nativeParams = methodToInvoke.get_parameter_infos();
+    const rttr::method* m_method;
+    int m_numArgs;
+    ArgConverter m_argConverters[MAX_ARGS];
+    ReturnConverter m_returnConverter;
+    const DirectMethod* m_direct;       // Batch calls only, nullptr: invoke through RTTR
+};
+
+// Pushes the dispatch descriptor for a method, returns false if the method can't be called from lua
+bool PushMethodDispatch(lua_State* L, const rttr::method& method)
+{
+    MethodDispatch* dispatch = (MethodDispatch*) lua_newuserdata(L, sizeof(MethodDispatch));
+    dispatch->m_method = &method;
+    dispatch->m_numArgs = (int) method.get_parameter_infos().size();
+    dispatch->m_returnConverter = ReturnConverterFor(method.get_return_type());
+    dispatch->m_direct = nullptr;
     
-    // Top of stack index = number of arguments passed
-    int numLuaArgs = lua_gettop(L);
-    int numNativeArgs = (int) nativeParams.size();
+    if (dispatch->m_numArgs > MethodDispatch::MAX_ARGS)
+    {
+        StringView name = method.get_name();
+        printf("Can't bind '%.*s', more than %d args\n", (int) name.size(), name.data(), MethodDispatch::MAX_ARGS);
+        dispatch->m_numArgs = -1;
+        return false;
+    }
     
-    printf("Number of lua args: %d\n", numLuaArgs);
-    printf("Number of native args: %d\n", numNativeArgs);
+    int i = 0;
+    for (auto& param : method.get_parameter_infos())
+    {
+        dispatch->m_argConverters[i++] = ArgConverterFor(param.get_type());
+    }
+    return true;
+}
+
+// Bound in place of a method PushMethodDispatch rejected, so the script gets an error saying why. Up-value 1: method dispatch
+int NotBindableFromLua(lua_State* L)
+{
+    const MethodDispatch& dispatch = *(const MethodDispatch*) lua_touserdata(L, lua_upvalueindex(1));
+    return luaL_error(L, "'%s' has more than %d args, not bindable", PushString(L, dispatch.m_method->get_name()), MethodDispatch::MAX_ARGS);
+}
+
+// Fixed arity invoke, no std::vector of arguments
+rttr::variant InvokeMethod(const rttr::method& methodToInvoke, const rttr::instance& object, const rttr::argument* args, int numArgs)
+{
+    switch (numArgs)
+    {
+        case 0: return methodToInvoke.invoke(object);
+        case 1: return methodToInvoke.invoke(object, args[0]);
+        case 2: return methodToInvoke.invoke(object, args[0], args[1]);
+        case 3: return methodToInvoke.invoke(object, args[0], args[1], args[2]);
+        case 4: return methodToInvoke.invoke(object, args[0], args[1], args[2], args[3]);
+        case 5: return methodToInvoke.invoke(object, args[0], args[1], args[2], args[3], args[4]);
+        case 6: return methodToInvoke.invoke(object, args[0], args[1], args[2], args[3], args[4], args[5]);
+    }
+    return rttr::variant();
+}
+
+// Calls the method with the lua arguments starting at firstLuaArg, object is empty for global methods
+int InvokeFromLua(lua_State* L, const MethodDispatch& dispatch, const rttr::instance& object, int firstLuaArg)
+{
+    const rttr::method& methodToInvoke = *dispatch.m_method;
+    
+    int numLuaArgs = lua_gettop(L) - (firstLuaArg - 1);
+    int numNativeArgs = dispatch.m_numArgs;
+    
+    // Number of lua args / number of native args
+    LUA_BINDING_TRACE(Call, Verbose, methodToInvoke.get_name().data(), (int) methodToInvoke.get_name().size(), numLuaArgs, numNativeArgs);
     
     if (numLuaArgs != numNativeArgs)
     {
-        printf("Error calling native function '%s', wrong number of args, expected %d, got %d\n",
-               methodToInvoke.get_name().to_string().c_str(), numNativeArgs, numLuaArgs);
-        assert(numLuaArgs == numNativeArgs);
+        LUA_BINDING_TRACE(Error, Error, methodToInvoke.get_name().data(), (int) methodToInvoke.get_name().size(), numLuaArgs, numNativeArgs);
+        return luaL_error(L, "Error calling native function '%s', wrong number of args, expected %d, got %d\n",
+                          PushString(L, methodToInvoke.get_name()), numNativeArgs, numLuaArgs);
+    }
+    
+    // For arguments passed by value, they will go out of scope! We need to have references to them before calling invoke
+    PassByValue pbv[MethodDispatch::MAX_ARGS];
+    rttr::argument args[MethodDispatch::MAX_ARGS];
+    
+    for (int i = 0; i < numNativeArgs; i++)
+    {
+        args[i] = dispatch.m_argConverters[i](L, firstLuaArg + i, pbv[i]);
     }
     
+    rttr::variant result = InvokeMethod(methodToInvoke, object, args, numNativeArgs);
+    
+    if (result.is_valid() == false)
+    {
+        LUA_BINDING_TRACE(Error, Error, methodToInvoke.get_name().data(), (int) methodToInvoke.get_name().size(), numLuaArgs, 0);
+        return luaL_error(L, "Unable to invoke '%s'\n", PushString(L, methodToInvoke.get_name()));
+    }
     
+    return dispatch.m_returnConverter(L, result);
+}
+
+int CallGlobalFromLua(lua_State* L)
+{
+    // Grab dispatch descriptor from up-value
+    const MethodDispatch& dispatch = *(const MethodDispatch*) lua_touserdata(L, lua_upvalueindex(1));
+    return InvokeFromLua(L, dispatch, rttr::instance(), 1);
+}
+
+// Property accessors, resolved once at binding time like MethodDispatch
+struct PropertyDispatch
+{
+    const rttr::property* m_property;
+    ArgConverter m_setter;
+    ReturnConverter m_getter;
+};
+
+// Pushes the dispatch descriptor for a property
+void PushPropertyDispatch(lua_State* L, const rttr::property& property)
+{
+    PropertyDispatch* dispatch = (PropertyDispatch*) lua_newuserdata(L, sizeof(PropertyDispatch));
+    dispatch->m_property = &property;
+    dispatch->m_setter = ArgConverterFor(property.get_type());
+    dispatch->m_getter = ReturnConverterFor(property.get_type());
+}
+
+// Object the method/property is used on. Checked against the class metatable, no string lookups
+UserDatumHeader* CheckUserDatum(lua_State* L, int metaTableIdx)
+{
+    if (lua_type(L, 1) != LUA_TUSERDATA || lua_getmetatable(L, 1) == 0)
+    {
+        luaL_argerror(L, 1, "expected an object (did you use '.' instead of ':'?)");
+    }
+    if (!lua_rawequal(L, -1, metaTableIdx))
+    {
+        luaL_argerror(L, 1, "object is of the wrong type");
+    }
+    lua_pop(L, 1);
+    return (UserDatumHeader*) lua_touserdata(L, 1);
+}
+
+// obj:Method(...). Up-values: 1 method dispatch, 2 class metatable
+int CallMethodFromLua(lua_State* L)
+{
+    const MethodDispatch& dispatch = *(const MethodDispatch*) lua_touserdata(L, lua_upvalueindex(1));
+    UserDatumHeader* object = CheckUserDatum(L, lua_upvalueindex(2));
+    return InvokeFromLua(L, dispatch, InstanceOf(object), 2);
+}
+
+/*
+ Batched member call: Class.batch.Method(objects, arg1, arg2...) calls objects[i]:Method(arg1[i], arg2[i]...) for every object.
+ Each argument is either an array (one value per object) or a single value passed to every call.
+ One crossing of the lua/C boundary for the whole array, the loop runs natively. Return values are discarded.
+ Methods with a direct thunk (DirectMethodRegistration) are called straight from the loop, others through RTTR.
+ Up-values: 1 method dispatch, 2 class metatable
+ */
+int BatchArgError(lua_State* L, const rttr::method& method, int luaArg, lua_Integer element, const char* message)
+{
+    return luaL_error(L, "bad argument #%d to batch '%s' (element %d: %s)", luaArg, PushString(L, method.get_name()), (int) element, message);
+}
+
+int CallMethodBatchFromLua(lua_State* L)
+{
+    const MethodDispatch& dispatch = *(const MethodDispatch*) lua_touserdata(L, lua_upvalueindex(1));
+    const rttr::method& methodToInvoke = *dispatch.m_method;
+    const DirectMethod* direct = dispatch.m_direct;                 // Once per batch, not per object
+    int numNativeArgs = dispatch.m_numArgs;
     
-    // For arguments passed by value, they will go out of scope! We need to have references to them before calling invoke_variadic
-    std::vector<PassByValue> pbv(numNativeArgs);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    if (lua_gettop(L) - 1 != numNativeArgs)
+    {
+        return luaL_error(L, "Error calling batch '%s', wrong number of args, expected %d, got %d\n",
+                          PushString(L, methodToInvoke.get_name()), numNativeArgs, lua_gettop(L) - 1);
+    }
     
-    // Native args to past to rttr invoke
-    std::vector<rttr::argument> nativeArgs(numNativeArgs);
-    auto nativeParamsIt = nativeParams.begin();
+    lua_Integer numObjects = (lua_Integer) lua_rawlen(L, 1);
     
-    // Loops all params and gets both native/lua type
-    for (int i = 0; i < numLuaArgs; i++, nativeParamsIt++)
+    // Single values are converted once, arrays are read per object
+    PassByValue pbv[MethodDispatch::MAX_ARGS];
+    rttr::argument args[MethodDispatch::MAX_ARGS];
+    lua_Number numbers[MethodDispatch::MAX_ARGS];                   // Direct thunk arguments
+    bool isArray[MethodDispatch::MAX_ARGS];
+    for (int a = 0; a < numNativeArgs; a++)
     {
-        const rttr::type nativeParamType = nativeParamsIt->get_type();
-        int luaArgIdx = i + 1;
-        
-        // Gets type
-        int luaType = lua_type(L, luaArgIdx);
+        int luaArg = a + 2;
+        isArray[a] = lua_type(L, luaArg) == LUA_TTABLE;
+        if (isArray[a])
+        {
+            if ((lua_Integer) lua_rawlen(L, luaArg) < numObjects)
+            {
+                return luaL_argerror(L, luaArg, "fewer values than there are objects");
+            }
+            if (!direct && dispatch.m_argConverters[a] == UnhandledArg)
+            {
+                return luaL_argerror(L, luaArg, "unrecognised parameter type");
+            }
+        }
+        else if (direct)
+        {
+            numbers[a] = luaL_checknumber(L, luaArg);
+        }
+        else
+        {
+            args[a] = dispatch.m_argConverters[a](L, luaArg, pbv[a]);
+        }
+    }
+    
+    int top = lua_gettop(L);
+    for (lua_Integer i = 1; i <= numObjects; i++)
+    {
+        lua_rawgeti(L, 1, i);
+        if (lua_type(L, -1) != LUA_TUSERDATA || lua_getmetatable(L, -1) == 0 || !lua_rawequal(L, -1, lua_upvalueindex(2)))
+        {
+            return BatchArgError(L, methodToInvoke, 1, i, "object of the wrong type");
+        }
+        UserDatumHeader* object = (UserDatumHeader*) lua_touserdata(L, top + 1);
         
-        // RTTR must have exact types
-        switch (luaType)
+        // Array values are checked here, so the converters never report a stack slot as the argument
+        for (int a = 0; a < numNativeArgs; a++)
         {
-            case LUA_TNUMBER:
-                
-                // Check type
-                if (nativeParamType == rttr::type::get<int>())
+            if (isArray[a])
+            {
+                lua_rawgeti(L, a + 2, i);
+                int isNumber = 0;
+                numbers[a] = lua_tonumberx(L, -1, &isNumber);
+                if (!isNumber)
                 {
-                    // Instead of putting it on the stack, we are storing the lua_tonumber in our vector
-                    doSomething<int>(pbv[i], lua_tonumber(L, luaArgIdx));
-                    nativeArgs[i] = pbv[i].intVal;
+                    return BatchArgError(L, methodToInvoke, a + 2, i, "number expected");
                 }
-                else if (nativeParamType == rttr::type::get<short>())
+                if (!direct)
                 {
-                    pbv[i].shortVal = (short) lua_tonumber(L, luaArgIdx);
-                    nativeArgs[i] = pbv[i].shortVal;
+                    args[a] = dispatch.m_argConverters[a](L, lua_gettop(L), pbv[a]);
                 }
-                else
-                {
-                    printf("Unrecognised parameter type '%s'\n", nativeParamType.get_name().to_string().c_str());
-                    assert(false);
-                }
-                
-                break;
-                
-            default:
-                assert(false); // Don't know type!
-                break;
+            }
         }
+        
+        if (direct)
+        {
+            direct->m_call(ObjectOf(object), numbers);
+        }
+        else if (InvokeMethod(methodToInvoke, InstanceOf(object), args, numNativeArgs).is_valid() == false)
+        {
+            return luaL_error(L, "Unable to invoke '%s'\n", PushString(L, methodToInvoke.get_name()));
+        }
+        lua_settop(L, top);
+    }
+    return 0;
+}
+
+/*
+ __index and __newindex of bound classes. Up-value 1 is the member table of the class, built once at binding time:
+ member name (interned lua string) -> method closure or PropertyDispatch userdata.
+ So resolving a member is one hash probe (lua_rawget), no rttr::type::get_method/get_property string lookup.
+ Anything that isn't a member goes to the user value table of the object.
+ Up-value 2 is the class metatable: the metamethods can be called directly (getmetatable(obj).__index({}, "x")),
+ so the object is checked like for methods.
+ */
+int IndexUserDatum(lua_State* L)
+{
+    // 1 = user datum, 2 = key
+    UserDatumHeader* object = CheckUserDatum(L, lua_upvalueindex(2));
+    lua_pushvalue(L, 2);
+    if (lua_rawget(L, lua_upvalueindex(1)) == LUA_TUSERDATA)    // Property
+    {
+        const PropertyDispatch& dispatch = *(const PropertyDispatch*) lua_touserdata(L, -1);
+        return dispatch.m_getter(L, dispatch.m_property->get_value(InstanceOf(object)));
+    }
+    if (!lua_isnil(L, -1))                                       // Method closure
+    {
+        return 1;
     }
     
-    rttr::variant result = methodToInvoke.invoke_variadic({}, nativeArgs);
-    int numberOfReturnValues = 0;
-    if (result.is_valid() == false)
+    // No user value table until a dynamic field is set: nothing to look up
+    if (lua_getuservalue(L, 1) != LUA_TTABLE)
     {
-        luaL_error(L, "Unable to invoke '%s'\n", methodToInvoke.get_name().to_string().c_str());
+        lua_pushnil(L);
+        return 1;
     }
-    // If there is a return
-    else if (result.is_type<void>() == false)
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    return 1;
+}
+
+int NewIndexUserDatum(lua_State* L)
+{
+    // 1 = user datum, 2 = key, 3 = value
+    UserDatumHeader* object = CheckUserDatum(L, lua_upvalueindex(2));
+    lua_pushvalue(L, 2);
+    int memberType = lua_rawget(L, lua_upvalueindex(1));
+    if (memberType == LUA_TUSERDATA)                             // Property
     {
-        // Handle int return
-        if (result.is_type<int>())
-        {
-            lua_pushnumber(L, result.get_value<int>());
-            numberOfReturnValues++;
-        }
-        else if (result.is_type<short>())
+        const PropertyDispatch& dispatch = *(const PropertyDispatch*) lua_touserdata(L, -1);
+        PassByValue pbv;
+        if (!dispatch.m_property->set_value(InstanceOf(object), dispatch.m_setter(L, 3, pbv)))
         {
-            lua_pushnumber(L, result.get_value<short>());
-            numberOfReturnValues++;
+            return luaL_error(L, "Unable to set '%s'", PushString(L, dispatch.m_property->get_name()));
         }
+        return 0;
+    }
+    if (memberType != LUA_TNIL)
+    {
+        return luaL_error(L, "Can't assign to method '%s'", lua_tostring(L, 2));
+    }
+    
+    // User value table, created on the first dynamic field
+    if (lua_getuservalue(L, 1) != LUA_TTABLE)
+    {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setuservalue(L, 1);
+    }
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 3);
+    lua_rawset(L, -3);
+    return 0;
+}
+
+void BindGlobalMethods(lua_State* L, const char* tableName)
+{
+    // Push new table and name it tableName
+    lua_newtable(L);                                                    // 1
+    
+    // Bind global methods!
+    for (auto& method : rttr::type::get_global_methods())
+    {
+        // Push name of method
+        PushString(L, method.get_name());                               // 2
         
-        else
-        {
-            luaL_error(L,
-                       "Unhandled return type '%s' from native method '%s'\n",
-                       result.get_type().get_name().to_string().c_str(),
-                       methodToInvoke.get_name().to_string().c_str());
-        }
+        bool bindable = PushMethodDispatch(L, method);                  // Resolve parameter/return converters once
+        lua_pushcclosure(L, bindable ? CallGlobalFromLua : NotBindableFromLua, 1);  // 3
         
+        // Set the table
+        lua_settable(L, -3);                                            //1[2] = 3
     }
     
-    return numberOfReturnValues;
+    lua_setglobal(L, tableName);
 }
 
 // Returns the meta table name for type t
@@ -154,28 +464,83 @@ std::string MetaTableName(const rttr::type& t)
     return metaTableName;
 }
 
+// Everything needed to create objects of a bound class, resolved once at binding time. Lives in a full userdata up-value
+struct ClassBinding
+{
+    const rttr::type* m_type;
+    InlineLayout m_layout;
+    size_t m_userDatumSize;
+    int m_metaTableRef;             // Registry reference, the metatable is pushed with lua_rawgeti instead of looked up by name
+};
+
+// Direct thunk for batch calls of a method, if one is registered and fits the class. Only for inline objects:
+// the thunk needs the object itself, not an rttr::variant holding it
+const DirectMethod* DirectMethodFor(const rttr::type& t, const ClassBinding& binding, const rttr::method& method)
+{
+    if (!t.get_metadata(BindingMetadata::InlineLayout).is_type<InlineLayout>())
+    {
+        return nullptr;
+    }
+    const DirectMethod* direct = FindDirectMethod(t.get_name(), method.get_name());
+    if (direct && (direct->m_numArgs != (int) method.get_parameter_infos().size() || direct->m_objectSize != binding.m_layout.m_size))
+    {
+        StringView name = method.get_name();
+        printf("Direct thunk of '%.*s' doesn't match its RTTR registration, not used\n", (int) name.size(), name.data());
+        return nullptr;
+    }
+    return direct;
+}
+
+// Pushes the class binding for type t
+void PushClassBinding(lua_State* L, const rttr::type& t)
+{
+    ClassBinding* binding = (ClassBinding*) lua_newuserdata(L, sizeof(ClassBinding));
+    binding->m_type = &t;
+    
+    rttr::variant layout = t.get_metadata(BindingMetadata::InlineLayout);
+    binding->m_layout = layout.is_type<InlineLayout>() ? layout.get_value<InlineLayout>() : VariantLayout();
+    binding->m_userDatumSize = UserDatumSize(binding->m_layout);
+    binding->m_metaTableRef = LUA_NOREF;                            // Set once the metatable exists
+}
+
 int CreateUserDatum(lua_State* L)
 {
-    rttr::type& typeToCreate = *(rttr::type*) lua_touserdata(L, lua_upvalueindex(1));
+    const ClassBinding& binding = *(const ClassBinding*) lua_touserdata(L, lua_upvalueindex(1));
+    const rttr::type& typeToCreate = *binding.m_type;
     
-    void* ud = lua_newuserdata(L, sizeof(rttr::variant));          // Get lua to create a new user datum as a variant
-    new (ud) rttr::variant(typeToCreate.create());                 // Placement new (Calls varient constructor without allocating memory.
-                                                                   // Since typeToCreate.create() is a rvalue, rttr::variant will use a move constructor
-    //-- rttr:variant& variant = *(rttr:variant*)ud; --
+    // Get lua to create a new user datum big enough for the header and the object itself
+    UserDatumHeader* header = (UserDatumHeader*) lua_newuserdata(L, binding.m_userDatumSize);
+    header->m_layout = &binding.m_layout;                          // Type tag, the binding outlives the object (it's an up-value of __gc)
+    binding.m_layout.m_construct(ObjectOf(header), typeToCreate);  // Placement new, no allocation besides the user datum
     
-    luaL_getmetatable(L, MetaTableName(typeToCreate).c_str());     // Retreive meta-table
-    lua_setmetatable(L, 1);                                        // Assign meta-table to user datum (our type). Pops metatable off stack
-
-    lua_newtable(L);                                               // Create new user table: Stores any additional value to the native object
-    lua_setuservalue(L, 1);                                        // Associate this userdatum with the non-native table
+    lua_rawgeti(L, LUA_REGISTRYINDEX, binding.m_metaTableRef);     // Retreive meta-table, no string building or hashing
+    lua_setmetatable(L, -2);                                       // Assign meta-table to user datum (our type). Pops metatable off stack
+    
+    // No user table yet, __newindex creates it when the script first stores a value the native object doesn't have
     
     return 1; // Return the userdatum
 }
 
+// CreateUserDatum as it was before the metatable reference was cached, kept for the benchmark
+int CreateUserDatumByName(lua_State* L)
+{
+    const ClassBinding& binding = *(const ClassBinding*) lua_touserdata(L, lua_upvalueindex(1));
+    const rttr::type& typeToCreate = *binding.m_type;
+    
+    UserDatumHeader* header = (UserDatumHeader*) lua_newuserdata(L, binding.m_userDatumSize);
+    header->m_layout = &binding.m_layout;
+    binding.m_layout.m_construct(ObjectOf(header), typeToCreate);
+    
+    luaL_getmetatable(L, MetaTableName(typeToCreate).c_str());     // std::string + registry lookup by name, every object
+    lua_setmetatable(L, -2);
+    
+    return 1;
+}
+
 int DestroyUserDatum(lua_State* L)
 {
-    rttr::variant* ud = (rttr::variant*) lua_touserdata(L, -1);    // Get user datum (variant)
-    ud->~variant();                                                // Call destructor on variant (will then internally call the type's destructor)
+    UserDatumHeader* header = (UserDatumHeader*) lua_touserdata(L, 1);
+    header->m_layout->m_destroy(ObjectOf(header));                 // Call destructor on the object (memory belongs to lua)
     return 0;
 }
 
@@ -193,25 +558,19 @@ void AutomatedBindingTutorial()
     lua_State* L = lua_newstate(ArenaAllocator::l_alloc, &pool);
     
     // --- BINDING GLOBAL METHODS TO LUA ---
+    BindGlobalMethods(L, "Global");
+    // ----------------------------
     
-    // Push new table and name it "Global"
-    lua_newtable(L);
-    lua_pushvalue(L, -1);
-    lua_setglobal(L, "Global");                                         // 1
-    lua_pushvalue(L, -1);
+    // --- BINDING DIRECT THUNKS TO LUA ---
     
-    // Bind global methods!
-    for (auto& method : rttr::type::get_global_methods())
+    // Same functions as Global, but called without RTTR
+    lua_newtable(L);
+    for (auto& binding : DirectBindings())
     {
-        // Push name of method
-        lua_pushstring(L, method.get_name().to_string().c_str());       // 2
-        
-        lua_pushlightuserdata(L, (void*) &method);
-        lua_pushcclosure(L, CallGlobalFromLua, 1);                      // 3
-        
-        // Set the table
-        lua_settable(L, -3);                                            //1[2] = 3
+        lua_pushcfunction(L, binding.m_function);
+        lua_setfield(L, -2, binding.m_name);
     }
+    lua_setglobal(L, "Direct");
     // ----------------------------
 
     // --- BINDING CLASSES TO LUA ---
@@ -221,24 +580,73 @@ void AutomatedBindingTutorial()
         {
             lua_newtable(L);                                                    // Create new class table
             lua_pushvalue(L, -1);                                               // Push table second time
-            lua_setglobal(L, classToRegister.get_name().to_string().c_str());   // Create global with class name pointing to created table
+            SetGlobal(L, classToRegister.get_name());                           // Create global with class name pointing to created table
             
-            lua_pushlightuserdata(L, (void*) &classToRegister);                 // Push upvalue pointer to our rttr type
+            PushClassBinding(L, classToRegister);                               // Push upvalue: type and object layout
+            int bindingIdx = lua_gettop(L);
+            lua_pushvalue(L, bindingIdx);
             lua_pushcclosure(L, CreateUserDatum, 1);                            // Push c function for user datum creation
-            lua_setfield(L, -2, "new");                                         // Set field for creation on class table
+            lua_setfield(L, -3, "new");                                         // Set field for creation on class table
             
             
             luaL_newmetatable(L, MetaTableName(classToRegister).c_str());                                // Create new type metatable. NOTE: Metatable will be shared by many objects
+            int metaTableIdx = lua_gettop(L);
+            lua_pushvalue(L, metaTableIdx);
+            ((ClassBinding*) lua_touserdata(L, bindingIdx))->m_metaTableRef = luaL_ref(L, LUA_REGISTRYINDEX);   // Resolve the metatable once
             
             lua_pushstring(L, "__gc");                                          // Push garbage collection metamethod name
-            lua_pushcfunction(L, DestroyUserDatum);                             // Push c function for user datum descruction
+            lua_pushvalue(L, bindingIdx);                                       // Keeps the class binding (layout) alive as long as objects use it
+            lua_pushcclosure(L, DestroyUserDatum, 1);                           // Push c function for user datum descruction
             lua_settable(L, -3);                                                // Add __gc (key) and DestroyUserDatum (value) onto metatable
             
+            // Member table: name -> method closure / property dispatch
+            lua_newtable(L);
+            for (auto& method : classToRegister.get_methods())
+            {
+                lua_CFunction call = PushMethodDispatch(L, method) ? CallMethodFromLua : NotBindableFromLua;
+                lua_pushvalue(L, metaTableIdx);                                 // To check self is one of ours
+                lua_pushcclosure(L, call, 2);
+                SetField(L, -2, method.get_name());
+            }
+            for (auto& property : classToRegister.get_properties())
+            {
+                PushPropertyDispatch(L, property);
+                SetField(L, -2, property.get_name());
+            }
+            
+            // Batched versions of the methods: Class.batch.Method(objects, ...)
+            lua_newtable(L);
+            const ClassBinding& binding = *(const ClassBinding*) lua_touserdata(L, bindingIdx);
+            for (auto& method : classToRegister.get_methods())
+            {
+                bool bindable = PushMethodDispatch(L, method);
+                if (bindable)
+                {
+                    ((MethodDispatch*) lua_touserdata(L, -1))->m_direct = DirectMethodFor(classToRegister, binding, method);
+                }
+                lua_pushvalue(L, metaTableIdx);
+                lua_pushcclosure(L, bindable ? CallMethodBatchFromLua : NotBindableFromLua, 2);
+                SetField(L, -2, method.get_name());
+            }
+            lua_setfield(L, bindingIdx - 1, "batch");                           // On the class table
+            
+            lua_pushvalue(L, -1);                                               // Both metamethods share the member table
+            lua_pushvalue(L, metaTableIdx);                                     // To check self is one of ours
+            lua_pushcclosure(L, IndexUserDatum, 2);
+            lua_setfield(L, metaTableIdx, "__index");
+            lua_pushvalue(L, metaTableIdx);
+            lua_pushcclosure(L, NewIndexUserDatum, 2);
+            lua_setfield(L, metaTableIdx, "__newindex");
             
+            lua_pop(L, 3);                                                      // Metatable, class binding, class table
         }
     }
     // ----------------------------
     
+    // Trace the calls made by the script (only when the trace is compiled in)
+    BindingTrace::SetLevel(TraceCategory::Call, TraceLevel::Verbose);
+    BindingTrace::SetLevel(TraceCategory::Error, TraceLevel::Error);
+    
     // Execute lua script
     int res = luaL_dostring(L, LUA_SCRIPT);
     if (res != LUA_OK)
@@ -246,5 +654,44 @@ void AutomatedBindingTutorial()
         printf("Error: %s\n", lua_tostring(L, -1));
     }
     
+    BindingTrace::SetLevel(TraceCategory::Call, TraceLevel::Off);
+    BindingTrace::Dump(stdout);
+    
+    // RTTR invoke vs direct thunk, same function
+    auto TimeScript = [L](const char* script) -> double
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        if (luaL_dostring(L, script) != LUA_OK)
+        {
+            printf("Error: %s\n", lua_tostring(L, -1));
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration<double, std::milli>(end - start).count();
+    };
+    
+    double rttrMs = TimeScript("local Mul = Global.Mul for i = 1, 100000 do Mul(i, 2) end");
+    double directMs = TimeScript("local Mul = Direct.Mul for i = 1, 100000 do Mul(i, 2) end");
+    printf("100000 calls to Mul, RTTR: %.2fms, direct thunk: %.2fms\n", rttrMs, directMs);
+    
+    // Sprite.new() with the cached metatable reference vs looking the metatable up by name
+    lua_getglobal(L, "Sprite");
+    lua_getfield(L, -1, "new");
+    lua_getupvalue(L, -1, 1);                                           // Same class binding
+    lua_pushcclosure(L, CreateUserDatumByName, 1);
+    lua_setfield(L, -3, "newByName");
+    lua_pop(L, 2);
+    
+    double byNameMs = TimeScript("local new = Sprite.newByName for i = 1, 100000 do new() end");
+    double cachedMs = TimeScript("local new = Sprite.new for i = 1, 100000 do new() end");
+    printf("100000 Sprite.new(), metatable by name: %.2fms (%.0f/s), cached ref: %.2fms (%.0f/s)\n",
+           byNameMs, 100000 / byNameMs * 1000.0, cachedMs, 100000 / cachedMs * 1000.0);
+    
+    // Per object calls vs one batched call over the whole array
+    luaL_dostring(L, "sprites = {} for i = 1, 10000 do sprites[i] = Sprite.new() end");
+    double perObjectMs = TimeScript("local sprites = sprites for frame = 1, 10 do for i = 1, #sprites do sprites[i]:Move(1, 2) end end");
+    double batchMs = TimeScript("local sprites, Move = sprites, Sprite.batch.Move for frame = 1, 10 do Move(sprites, 1, 2) end");
+    luaL_dostring(L, "sprites = nil");
+    printf("10 frames of 10000 sprites Move, per object: %.2fms, batched: %.2fms\n", perObjectMs, batchMs);
+    
     lua_close(L);
 }
@@ -1,5 +1,8 @@
-
 #pragma once
 
+struct lua_State;
 
 void AutomatedBindingTutorial();
+
+// Binds every RTTR global method into a global table of that name (called through CallGlobalFromLua)
+void BindGlobalMethods(lua_State* L, const char* tableName);
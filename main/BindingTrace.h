@@ -0,0 +1,137 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+/*
+ Trace facility for the binding layer (AutomatedBinding.cpp).
+
+ Compiled in with LUA_BINDING_TRACE_ENABLED (CMake option LUA_TUTORIAL_BINDING_TRACE, always on in debug builds).
+ Otherwise LUA_BINDING_TRACE expands to nothing and its arguments are never evaluated.
+ When compiled in, every category starts Off: turn categories on with BindingTrace::SetLevel.
+
+ Records go into a fixed ring buffer (the oldest get overwritten) instead of stdout,
+ BindingTrace::Dump prints them later.
+ Levels can be changed from any thread. The ring buffer is one for the whole process and unsynchronized:
+ a slot is claimed atomically but written without a lock, so a record can be torn if another thread
+ wraps around onto it, and Dump must only run while no thread is tracing.
+ */
+#if !defined(LUA_BINDING_TRACE_ENABLED) && defined(LUA_TUTORIAL_DEBUG)
+#define LUA_BINDING_TRACE_ENABLED 1
+#endif
+
+enum class TraceCategory
+{
+    Call,       // Every native call from lua
+    Error,      // Failed calls
+    Count
+};
+
+enum class TraceLevel
+{
+    Off,
+    Error,
+    Info,
+    Verbose
+};
+
+struct TraceRecord
+{
+    uint64_t m_timeNs;
+    TraceCategory m_category;
+    TraceLevel m_level;
+    const char* m_name;     // Must outlive the trace (RTTR names, literals)
+    int m_nameLength;
+    int m_values[2];
+};
+
+struct BindingTrace
+{
+    static constexpr int RING_SIZE = 4096;      // Power of two
+
+    struct Ring
+    {
+        TraceRecord m_records[RING_SIZE];
+        std::atomic<uint32_t> m_next;
+    };
+
+    static Ring& GetRing()
+    {
+        static Ring s_ring;
+        return s_ring;
+    }
+
+    // Atomic: set from one thread while others trace. Relaxed, a late level change only costs a record or two
+    static std::atomic<int>* Levels()
+    {
+        static std::atomic<int> s_levels[(int) TraceCategory::Count] = {};
+        return s_levels;
+    }
+
+    static void SetLevel(TraceCategory category, TraceLevel level)
+    {
+        Levels()[(int) category].store((int) level, std::memory_order_relaxed);
+    }
+
+    static bool IsEnabled(TraceCategory category, TraceLevel level)
+    {
+        return (int) level <= Levels()[(int) category].load(std::memory_order_relaxed) && level != TraceLevel::Off;
+    }
+
+    static void Record(TraceCategory category, TraceLevel level, const char* name, int nameLength, int value0, int value1)
+    {
+        Ring& ring = GetRing();
+        uint32_t index = ring.m_next.fetch_add(1, std::memory_order_relaxed);
+        TraceRecord& record = ring.m_records[index & (RING_SIZE - 1)];
+        record.m_timeNs = (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        record.m_category = category;
+        record.m_level = level;
+        record.m_name = name;
+        record.m_nameLength = nameLength;
+        record.m_values[0] = value0;
+        record.m_values[1] = value1;
+    }
+
+    static const char* CategoryName(TraceCategory category)
+    {
+        switch (category)
+        {
+            case TraceCategory::Call: return "call";
+            case TraceCategory::Error: return "error";
+            default: return "?";
+        }
+    }
+
+    // Prints the buffered records, oldest first, and empties the buffer
+    static void Dump(FILE* out)
+    {
+        Ring& ring = GetRing();
+        uint32_t end = ring.m_next.exchange(0);
+        uint32_t begin = end > RING_SIZE ? end - RING_SIZE : 0;
+        for (uint32_t i = begin; i < end; i++)
+        {
+            const TraceRecord& record = ring.m_records[i & (RING_SIZE - 1)];
+            fprintf(out, "[%llu] %s %.*s (%d, %d)\n",
+                    (unsigned long long) record.m_timeNs,
+                    CategoryName(record.m_category),
+                    record.m_nameLength, record.m_name,
+                    record.m_values[0], record.m_values[1]);
+        }
+    }
+};
+
+#if defined(LUA_BINDING_TRACE_ENABLED)
+#define LUA_BINDING_TRACE(category, level, name, nameLength, value0, value1)                        \
+    do                                                                                              \
+    {                                                                                               \
+        if (BindingTrace::IsEnabled(TraceCategory::category, TraceLevel::level))                    \
+        {                                                                                           \
+            BindingTrace::Record(TraceCategory::category, TraceLevel::level, name, nameLength, value0, value1); \
+        }                                                                                           \
+    } while (0)
+#else
+#define LUA_BINDING_TRACE(category, level, name, nameLength, value0, value1) do { } while (0)
+#endif
@@ -0,0 +1,203 @@
+#pragma once
+
+#include "LuaString.h"
+#include "lua.hpp"
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+ Compile-time alternative to the RTTR binding in AutomatedBinding.cpp.
+ DirectThunk deduces the signature of a free function and produces a lua_CFunction that reads the
+ arguments straight off the lua stack and calls the function directly: no variants, no type erasure.
+
+ lua_pushcfunction(L, LUA_DIRECT_THUNK(Add));       // short Add(short, short)
+ */
+
+// Converts between lua stack values and C++ values
+template <typename T, typename Enable = void>
+struct LuaValue;
+
+template <typename T>
+struct LuaValue<T, typename std::enable_if<std::is_arithmetic<T>::value>::type>
+{
+    static T Get(lua_State* L, int idx)
+    {
+        return (T) luaL_checknumber(L, idx);
+    }
+
+    static void Push(lua_State* L, T value)
+    {
+        lua_pushnumber(L, (lua_Number) value);
+    }
+};
+
+template <>
+struct LuaValue<bool>
+{
+    static bool Get(lua_State* L, int idx)
+    {
+        return lua_toboolean(L, idx) != 0;
+    }
+
+    static void Push(lua_State* L, bool value)
+    {
+        lua_pushboolean(L, value);
+    }
+};
+
+template <>
+struct LuaValue<const char*>
+{
+    static const char* Get(lua_State* L, int idx)
+    {
+        return luaL_checkstring(L, idx);
+    }
+
+    static void Push(lua_State* L, const char* value)
+    {
+        lua_pushstring(L, value);
+    }
+};
+
+template <typename Signature, Signature* Function>
+struct DirectThunk;
+
+template <typename R, typename... Args, R (*Function)(Args...)>
+struct DirectThunk<R(Args...), Function>
+{
+    static int Call(lua_State* L)
+    {
+        if (lua_gettop(L) != (int) sizeof...(Args))
+        {
+            return luaL_error(L, "Wrong number of args, expected %d, got %d", (int) sizeof...(Args), lua_gettop(L));
+        }
+        return Invoke(L, std::is_void<R>(), std::index_sequence_for<Args...>());
+    }
+
+    // No return value
+    template <size_t... I>
+    static int Invoke(lua_State* L, std::true_type /*returnsVoid*/, std::index_sequence<I...>)
+    {
+        (void) L;
+        Function(LuaValue<typename std::decay<Args>::type>::Get(L, (int) I + 1)...);
+        return 0;
+    }
+
+    template <size_t... I>
+    static int Invoke(lua_State* L, std::false_type /*returnsVoid*/, std::index_sequence<I...>)
+    {
+        LuaValue<typename std::decay<R>::type>::Push(L, Function(LuaValue<typename std::decay<Args>::type>::Get(L, (int) I + 1)...));
+        return 1;
+    }
+};
+
+#define LUA_DIRECT_THUNK(function) DirectThunk<decltype(function), &function>::Call
+
+/*
+ Functions bound with direct thunks, registered before main (like RTTR_REGISTRATION)
+ so the binding code doesn't need a header for them.
+
+ static DirectRegistration s_add("Add", LUA_DIRECT_THUNK(Add));
+ */
+struct DirectBinding
+{
+    const char* m_name;
+    lua_CFunction m_function;
+};
+
+inline std::vector<DirectBinding>& DirectBindings()
+{
+    static std::vector<DirectBinding> s_bindings;
+    return s_bindings;
+}
+
+struct DirectRegistration
+{
+    DirectRegistration(const char* name, lua_CFunction function)
+    {
+        DirectBindings().push_back({ name, function });
+    }
+};
+
+/*
+ Member functions called straight from a native loop (Class.batch.Method in AutomatedBinding.cpp):
+ no lua stack and no RTTR invoke per object. The caller has read the arguments as numbers already,
+ so only arithmetic parameters are supported, and the return value is discarded.
+ Only used for classes stored inline in their user datum (InlineLayout), where the object is a plain C++ object
+ constructed in place in the user datum, not an rttr::variant holding it.
+
+ static DirectMethodRegistration s_move("Sprite", "Move", LUA_DIRECT_METHOD(Sprite::Move));
+ */
+typedef void (*DirectMethodCall)(void* object, const lua_Number* args);
+
+template <typename Signature, Signature Method>
+struct DirectMethodThunk;
+
+template <typename C, typename R, typename... Args, R (C::*Method)(Args...)>
+struct DirectMethodThunk<R (C::*)(Args...), Method>
+{
+    static constexpr int NUM_ARGS = (int) sizeof...(Args);
+    static constexpr size_t OBJECT_SIZE = sizeof(C);
+
+    static void Call(void* object, const lua_Number* args)
+    {
+        Invoke(static_cast<C*>(object), args, std::index_sequence_for<Args...>());
+    }
+
+    template <size_t... I>
+    static void Invoke(C* object, const lua_Number* args, std::index_sequence<I...>)
+    {
+        (void) args;
+        (object->*Method)(Arg<typename std::decay<Args>::type>(args[I])...);
+    }
+
+    template <typename T>
+    static T Arg(lua_Number value)
+    {
+        static_assert(std::is_arithmetic<T>::value, "direct methods only take arithmetic arguments");
+        return (T) value;
+    }
+};
+
+// Call, number of args and object size, in DirectMethodRegistration's argument order
+#define LUA_DIRECT_METHOD(method) \
+    DirectMethodThunk<decltype(&method), &method>::Call, \
+    DirectMethodThunk<decltype(&method), &method>::NUM_ARGS, \
+    DirectMethodThunk<decltype(&method), &method>::OBJECT_SIZE
+
+struct DirectMethod
+{
+    const char* m_className;
+    const char* m_methodName;
+    DirectMethodCall m_call;
+    int m_numArgs;
+    size_t m_objectSize;        // Checked against the class layout at binding time
+};
+
+inline std::vector<DirectMethod>& DirectMethods()
+{
+    static std::vector<DirectMethod> s_methods;
+    return s_methods;
+}
+
+// Linear search, only done at binding time. nullptr if the method has no direct thunk
+inline const DirectMethod* FindDirectMethod(StringView className, StringView methodName)
+{
+    for (auto& method : DirectMethods())
+    {
+        if (className == StringView(method.m_className) && methodName == StringView(method.m_methodName))
+        {
+            return &method;
+        }
+    }
+    return nullptr;
+}
+
+struct DirectMethodRegistration
+{
+    DirectMethodRegistration(const char* className, const char* methodName, DirectMethodCall call, int numArgs, size_t objectSize)
+    {
+        DirectMethods().push_back({ className, methodName, call, numArgs, objectSize });
+    }
+};
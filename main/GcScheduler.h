@@ -0,0 +1,243 @@
+#pragma once
+
+#include "AllocatorStats.h"
+#include "ArenaAllocator.h"
+#include "lua.hpp"
+#include <chrono>
+#include <cstdio>
+#include <string.h>
+
+/*
+ Host driven garbage collection for frame based hosts: the collector only runs when Tick() is called
+ (once per frame), and only for a time budget.
+
+ The scheduler stops lua's automatic collection, then every tick:
+ - between cycles, skips while the heap is below pause% of what was live after the last cycle (what LUA_GCSETPAUSE does).
+   Once a cycle started it is stepped every tick until it ends, even if sweeping brings the heap back under that
+ - otherwise runs LUA_GCSTEP in small steps until the budget is spent, or it has done as much work as
+   was allocated since the last tick (read from the allocator's byte counters), or the cycle ended.
+ The step size adapts so a single step stays around a quarter of the budget.
+ Should the heap still pass m_emergencyKb, a full collection is done regardless of the budget.
+
+ Every step is timed into a per-state pause histogram.
+
+ Lua 5.3 only has the incremental collector (generational mode came with 5.4), so only pause and stepmul can be tuned.
+
+ StatsAllocator<GlobalAllocator> stats(global);
+ lua_State* L = lua_newstate(StaticAllocator<StatsAllocator<GlobalAllocator>>::l_alloc, &stats);
+ GcScheduler gc(L, &stats.m_stats, 500);        // 0.5ms per frame
+ ...
+ gc.Tick();                                     // End of frame
+ */
+struct GcScheduler
+{
+    // Bucket i: pauses in [2^i, 2^(i+1)) microseconds, bucket 0 everything under 2us
+    static constexpr int NUM_HISTOGRAM_BUCKETS = 16;
+    static constexpr int MIN_STEP_KB = 1;
+    static constexpr int MAX_STEP_KB = 4096;
+
+    lua_State* m_state;
+    const AllocatorStats* m_allocatorStats;     // nullptr: allocation rate estimated from LUA_GCCOUNT
+    double m_budgetUs;
+    int m_stepKb;
+    int m_pause;                                // Percent, like LUA_GCSETPAUSE
+    int m_stepMul;                              // Percent, like LUA_GCSETSTEPMUL
+    size_t m_emergencyKb;                       // 0: no limit
+
+    size_t m_lastAllocatedBytes;
+    size_t m_liveKbAfterCycle;
+    bool m_cycleInProgress;                     // Started stepping, LUA_GCSTEP hasn't reported the end yet
+
+    // Stats
+    size_t m_pauseHistogram[NUM_HISTOGRAM_BUCKETS];
+    double m_maxPauseUs;
+    double m_totalPauseUs;
+    size_t m_ticks;
+    size_t m_steps;
+    size_t m_cycles;
+    size_t m_ticksOverBudget;
+    size_t m_emergencyCollections;
+
+    GcScheduler(lua_State* L, const AllocatorStats* allocatorStats, double budgetUs)
+    : m_state(L),
+    m_allocatorStats(allocatorStats),
+    m_budgetUs(budgetUs),
+    m_stepKb(16),
+    m_emergencyKb(0),
+    m_liveKbAfterCycle(0),
+    m_cycleInProgress(false),
+    m_maxPauseUs(0.0),
+    m_totalPauseUs(0.0),
+    m_ticks(0),
+    m_steps(0),
+    m_cycles(0),
+    m_ticksOverBudget(0),
+    m_emergencyCollections(0)
+    {
+        memset(m_pauseHistogram, 0, sizeof(m_pauseHistogram));
+
+        // Start from lua's own settings
+        m_pause = lua_gc(L, LUA_GCSETPAUSE, 200);
+        lua_gc(L, LUA_GCSETPAUSE, m_pause);
+        m_stepMul = lua_gc(L, LUA_GCSETSTEPMUL, 200);
+        lua_gc(L, LUA_GCSETSTEPMUL, m_stepMul);
+
+        lua_gc(L, LUA_GCSTOP, 0);
+        m_lastAllocatedBytes = AllocatedBytes();
+    }
+
+    // Hands collection back to lua
+    ~GcScheduler()
+    {
+        lua_gc(m_state, LUA_GCRESTART, 0);
+    }
+
+    GcScheduler(const GcScheduler&) = delete;
+    GcScheduler& operator=(const GcScheduler&) = delete;
+
+    // Returns the previous value
+    int SetPause(int percent)
+    {
+        int previous = m_pause;
+        m_pause = percent;
+        lua_gc(m_state, LUA_GCSETPAUSE, percent);
+        return previous;
+    }
+
+    // Work done per KB allocated, returns the previous value
+    int SetStepMul(int percent)
+    {
+        m_stepMul = percent;
+        return lua_gc(m_state, LUA_GCSETSTEPMUL, percent);
+    }
+
+    size_t HeapKb() const
+    {
+        return (size_t) lua_gc(m_state, LUA_GCCOUNT, 0);
+    }
+
+    // Total bytes the state ever asked for (only ever grows)
+    size_t AllocatedBytes() const
+    {
+        if (m_allocatorStats)
+        {
+            return m_allocatorStats->m_bytesAllocated;
+        }
+        // Without the allocator's counters: heap growth since the last tick (misses what was freed meanwhile)
+        size_t heapBytes = HeapKb() * 1024 + (size_t) lua_gc(m_state, LUA_GCCOUNTB, 0);
+        return heapBytes > m_lastAllocatedBytes ? heapBytes : m_lastAllocatedBytes;
+    }
+
+    static double MicrosecondsSince(std::chrono::high_resolution_clock::time_point start)
+    {
+        return std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+
+    void RecordPause(double us)
+    {
+        size_t whole = (size_t) us;
+        int bucket = whole < 2 ? 0 : ArenaAllocator::FloorLog2(whole);
+        m_pauseHistogram[bucket < NUM_HISTOGRAM_BUCKETS ? bucket : NUM_HISTOGRAM_BUCKETS - 1]++;
+        m_totalPauseUs += us;
+        if (us > m_maxPauseUs)
+        {
+            m_maxPauseUs = us;
+        }
+    }
+
+    // One LUA_GCSTEP, timed. Returns true when it finished a cycle
+    bool Step(int stepKb)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        bool cycleEnded = lua_gc(m_state, LUA_GCSTEP, stepKb) != 0;
+        double us = MicrosecondsSince(start);
+        RecordPause(us);
+        m_steps++;
+
+        // Keep single steps around a quarter of the budget
+        if (us > m_budgetUs / 4 && m_stepKb > MIN_STEP_KB)
+        {
+            m_stepKb /= 2;
+        }
+        else if (us < m_budgetUs / 16 && m_stepKb < MAX_STEP_KB)
+        {
+            m_stepKb *= 2;
+        }
+
+        if (cycleEnded)
+        {
+            m_cycleInProgress = false;
+            m_cycles++;
+            m_liveKbAfterCycle = HeapKb();
+        }
+        return cycleEnded;
+    }
+
+    // Call once per frame
+    void Tick()
+    {
+        m_ticks++;
+        size_t allocatedBytes = AllocatedBytes();
+        double owedKb = (double) (allocatedBytes - m_lastAllocatedBytes) / 1024.0 * m_stepMul / 100.0;
+        m_lastAllocatedBytes = allocatedBytes;
+
+        size_t heapKb = HeapKb();
+        if (m_emergencyKb && heapKb > m_emergencyKb)
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            lua_gc(m_state, LUA_GCCOLLECT, 0);
+            RecordPause(MicrosecondsSince(start));
+            m_emergencyCollections++;
+            m_ticksOverBudget++;
+            m_cycleInProgress = false;
+            m_liveKbAfterCycle = HeapKb();
+            return;
+        }
+
+        // Between cycles: wait for the heap to grow by pause%. Lua only pauses there, never mid-cycle
+        if (!m_cycleInProgress)
+        {
+            if (heapKb * 100 < m_liveKbAfterCycle * m_pause)
+            {
+                return;
+            }
+            m_cycleInProgress = true;
+        }
+
+        auto tickStart = std::chrono::high_resolution_clock::now();
+
+        // Step 0 does one small step and drops the debt lua counted itself since the last tick,
+        // the next steps then do about stepKb * stepmul% of work each
+        if (!Step(0))
+        {
+            while (owedKb > 0 && MicrosecondsSince(tickStart) + m_budgetUs / 4 < m_budgetUs)
+            {
+                int stepKb = m_stepKb;
+                if (Step(stepKb))
+                {
+                    break;
+                }
+                owedKb -= (double) stepKb * m_stepMul / 100.0;
+            }
+        }
+
+        if (MicrosecondsSince(tickStart) > m_budgetUs)
+        {
+            m_ticksOverBudget++;
+        }
+    }
+
+    void PrintStats(FILE* out) const
+    {
+        fprintf(out, "%d ticks (%d over budget), %d steps, %d cycles, %d emergency collections, max pause %.1fus, total %.1fus, heap %dKB\n",
+                (int) m_ticks, (int) m_ticksOverBudget, (int) m_steps, (int) m_cycles, (int) m_emergencyCollections,
+                m_maxPauseUs, m_totalPauseUs, (int) HeapKb());
+        for (int i = 0; i < NUM_HISTOGRAM_BUCKETS; i++)
+        {
+            if (m_pauseHistogram[i])
+            {
+                fprintf(out, "  < %6dus: %d\n", 2 << i, (int) m_pauseHistogram[i]);
+            }
+        }
+    }
+};
@@ -0,0 +1,328 @@
+#pragma once
+
+#include "lua.hpp"
+#include <string.h>
+#include <string>
+#include <utility>
+
+/*
+ Strings between C++ and lua without extra copies.
+
+ StringView is a pointer + length, made from a const char*, a std::string or anything with data() and size()
+ (rttr::string_view: RTTR names can be pushed without to_string()). Push/read helpers always pass the length,
+ so no strlen and no temporary std::string.
+ Reading returns a view of lua's own string: valid while the value is reachable (on the stack, in a table...).
+
+ ExternalBuffer exposes large immutable native memory (config blobs, payloads, a mapped file) to lua without
+ copying it into lua's string heap. The user datum only holds pointer + length (+ optional release callback,
+ called when lua collects it). It has string-like methods, only sub() and tostring() copy:
+   #buffer, buffer:len()
+   buffer:sub(i [, j])          string, same index rules as string.sub
+   buffer:byte([i [, j]])       integers
+   buffer:find(text [, init])   start, end of a plain (not pattern) match, or nil
+   buffer:view(i [, j])         ExternalBuffer over a part of this one, no copy
+   buffer:tostring()            the whole buffer as a lua string
+
+ PushExternalBuffer(L, blob.data(), blob.size());
+ */
+struct StringView
+{
+    const char* m_data;
+    size_t m_size;
+
+    StringView()
+    : m_data(""), m_size(0)
+    { }
+
+    StringView(const char* data, size_t size)
+    : m_data(data), m_size(size)
+    { }
+
+    StringView(const char* string)
+    : m_data(string), m_size(strlen(string))
+    { }
+
+    // std::string, rttr::string_view...
+    template <typename S, typename = decltype(std::declval<const S&>().data()), typename = decltype(std::declval<const S&>().size())>
+    StringView(const S& string)
+    : m_data(string.data()), m_size(string.size())
+    { }
+
+    // A view of a temporary would dangle as soon as the statement ends
+    StringView(std::string&&) = delete;
+
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    bool operator==(StringView other) const
+    {
+        return m_size == other.m_size && memcmp(m_data, other.m_data, m_size) == 0;
+    }
+
+    bool operator!=(StringView other) const
+    {
+        return !(*this == other);
+    }
+
+    // Offset of the first occurrence at or after start, or m_size + 1 when there is none
+    size_t Find(StringView text, size_t start = 0) const
+    {
+        if (text.m_size == 0)
+        {
+            return start <= m_size ? start : m_size + 1;
+        }
+        if (start > m_size || text.m_size > m_size - start)
+        {
+            return m_size + 1;
+        }
+        const char* last = m_data + (m_size - text.m_size);
+        for (const char* p = m_data + start; p <= last; p++)
+        {
+            p = (const char*) memchr(p, text.m_data[0], (size_t) (last - p) + 1);
+            if (p == nullptr)
+            {
+                break;
+            }
+            if (memcmp(p, text.m_data, text.m_size) == 0)
+            {
+                return (size_t) (p - m_data);
+            }
+        }
+        return m_size + 1;
+    }
+};
+
+// Returns lua's copy (NUL terminated, valid while it's on the stack)
+inline const char* PushString(lua_State* L, StringView string)
+{
+    return lua_pushlstring(L, string.data(), string.size());
+}
+
+// Empty view when the value isn't a string (numbers are converted in place, like lua_tolstring)
+inline StringView ToStringView(lua_State* L, int idx)
+{
+    size_t size = 0;
+    const char* data = lua_tolstring(L, idx, &size);
+    return data ? StringView(data, size) : StringView();
+}
+
+inline StringView CheckStringView(lua_State* L, int arg)
+{
+    size_t size = 0;
+    const char* data = luaL_checklstring(L, arg, &size);
+    return StringView(data, size);
+}
+
+// t[key] = value on top of the stack (popped), for keys that aren't NUL terminated
+inline void SetField(lua_State* L, int tableIdx, StringView key)
+{
+    tableIdx = lua_absindex(L, tableIdx);
+    PushString(L, key);
+    lua_insert(L, -2);
+    lua_settable(L, tableIdx);
+}
+
+inline void SetGlobal(lua_State* L, StringView name)
+{
+    lua_pushglobaltable(L);
+    lua_insert(L, -2);
+    SetField(L, -2, name);
+    lua_pop(L, 1);
+}
+
+struct ExternalBuffer
+{
+    static constexpr const char* META_TABLE_NAME = "ExternalBuffer";
+
+    typedef void (*Release)(void* owner);
+
+    const char* m_data;
+    size_t m_size;
+    Release m_release;      // Called on __gc, nullptr if lua doesn't own the memory
+    void* m_owner;
+
+    StringView View() const
+    {
+        return StringView(m_data, m_size);
+    }
+
+    static ExternalBuffer& Check(lua_State* L, int arg)
+    {
+        return *(ExternalBuffer*) luaL_checkudata(L, arg, META_TABLE_NAME);
+    }
+
+    // string.sub rules: negative counts from the end, 1-based
+    static lua_Integer RelativePosition(lua_Integer position, size_t size)
+    {
+        if (position >= 0)
+        {
+            return position;
+        }
+        if ((size_t) 0 - (size_t) position > size)
+        {
+            return 0;
+        }
+        return (lua_Integer) size + position + 1;
+    }
+
+    // Clamps [i, j] to the buffer, false when the range is empty
+    static bool Range(lua_State* L, size_t size, int firstArg, lua_Integer defaultStart, lua_Integer defaultEnd, size_t& start, size_t& end)
+    {
+        lua_Integer i = RelativePosition(luaL_optinteger(L, firstArg, defaultStart), size);
+        lua_Integer j = RelativePosition(luaL_optinteger(L, firstArg + 1, defaultEnd), size);
+        if (i < 1)
+        {
+            i = 1;
+        }
+        if (j > (lua_Integer) size)
+        {
+            j = (lua_Integer) size;
+        }
+        if (i > j)
+        {
+            return false;
+        }
+        start = (size_t) i - 1;
+        end = (size_t) j;
+        return true;
+    }
+
+    static int Length(lua_State* L)
+    {
+        lua_pushinteger(L, (lua_Integer) Check(L, 1).m_size);
+        return 1;
+    }
+
+    static int Sub(lua_State* L)
+    {
+        ExternalBuffer& buffer = Check(L, 1);
+        size_t start, end;
+        if (Range(L, buffer.m_size, 2, 1, -1, start, end))
+        {
+            lua_pushlstring(L, buffer.m_data + start, end - start);
+        }
+        else
+        {
+            lua_pushliteral(L, "");
+        }
+        return 1;
+    }
+
+    static int Byte(lua_State* L)
+    {
+        ExternalBuffer& buffer = Check(L, 1);
+        lua_Integer first = luaL_optinteger(L, 2, 1);
+        size_t start, end;
+        if (!Range(L, buffer.m_size, 2, first, first, start, end))
+        {
+            return 0;
+        }
+        int count = (int) (end - start);
+        luaL_checkstack(L, count, "string slice too long");
+        for (size_t i = start; i < end; i++)
+        {
+            lua_pushinteger(L, (unsigned char) buffer.m_data[i]);
+        }
+        return count;
+    }
+
+    static int Find(lua_State* L)
+    {
+        ExternalBuffer& buffer = Check(L, 1);
+        StringView text = CheckStringView(L, 2);
+        lua_Integer init = RelativePosition(luaL_optinteger(L, 3, 1), buffer.m_size);
+        if (init < 1)
+        {
+            init = 1;
+        }
+        if (init > (lua_Integer) buffer.m_size + 1)
+        {
+            lua_pushnil(L);
+            return 1;
+        }
+        size_t found = buffer.View().Find(text, (size_t) init - 1);
+        if (found > buffer.m_size)
+        {
+            lua_pushnil(L);
+            return 1;
+        }
+        lua_pushinteger(L, (lua_Integer) found + 1);
+        lua_pushinteger(L, (lua_Integer) (found + text.size()));
+        return 2;
+    }
+
+    // The view keeps the buffer it looks into alive through its user value
+    static int SubView(lua_State* L)
+    {
+        ExternalBuffer& buffer = Check(L, 1);
+        size_t start, end;
+        if (!Range(L, buffer.m_size, 2, 1, -1, start, end))
+        {
+            start = end = 0;
+        }
+        Push(L, buffer.m_data + start, end - start, nullptr, nullptr);
+        lua_pushvalue(L, 1);
+        lua_setuservalue(L, -2);
+        return 1;
+    }
+
+    static int ToString(lua_State* L)
+    {
+        ExternalBuffer& buffer = Check(L, 1);
+        PushString(L, buffer.View());
+        return 1;
+    }
+
+    static int Collect(lua_State* L)
+    {
+        ExternalBuffer& buffer = *(ExternalBuffer*) lua_touserdata(L, 1);
+        if (buffer.m_release)
+        {
+            buffer.m_release(buffer.m_owner);
+            buffer.m_release = nullptr;
+        }
+        return 0;
+    }
+
+    static void PushMetaTable(lua_State* L)
+    {
+        if (luaL_newmetatable(L, META_TABLE_NAME))
+        {
+            static const luaL_Reg methods[] =
+            {
+                { "len", Length },
+                { "sub", Sub },
+                { "byte", Byte },
+                { "find", Find },
+                { "view", SubView },
+                { "tostring", ToString },
+                { nullptr, nullptr }
+            };
+            luaL_newlib(L, methods);
+            lua_setfield(L, -2, "__index");
+            lua_pushcfunction(L, Length);
+            lua_setfield(L, -2, "__len");
+            lua_pushcfunction(L, Collect);
+            lua_setfield(L, -2, "__gc");
+        }
+    }
+
+    // The memory must stay valid and unchanged until release is called (or for the state's lifetime without one)
+    static ExternalBuffer& Push(lua_State* L, const char* data, size_t size, Release release, void* owner)
+    {
+        ExternalBuffer* buffer = (ExternalBuffer*) lua_newuserdata(L, sizeof(ExternalBuffer));
+        buffer->m_data = data;
+        buffer->m_size = size;
+        buffer->m_release = release;
+        buffer->m_owner = owner;
+        PushMetaTable(L);
+        lua_setmetatable(L, -2);
+        return *buffer;
+    }
+};
+
+inline ExternalBuffer& PushExternalBuffer(lua_State* L, const char* data, size_t size, ExternalBuffer::Release release = nullptr, void* owner = nullptr)
+{
+    return ExternalBuffer::Push(L, data, size, release, owner);
+}
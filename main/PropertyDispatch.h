@@ -0,0 +1,184 @@
+#pragma once
+
+#include "lua.hpp"
+#include <assert.h>
+#include <string.h>
+
+/*
+ __index / __newindex for user data of type T, with a fixed set of native properties.
+
+ Lua interns short strings: every "x" of a lua_State is the same string object. So property names are pushed
+ once at binding time (kept alive as up-values) and their interned char pointers remembered. Looking up a
+ property is then comparing the key's pointer against them: no strcmp, no hashing.
+ Methods live in a table captured as up-value, not fetched through a global on every access.
+
+ Lookup order: native property, user value table (dynamic fields), method table.
+ The user value table is only created when a script first sets a dynamic field.
+ The metamethods check argument 1 against the metatable: they can be called directly (getmetatable(s).__index({}, "x")).
+
+ PropertyDispatcher<Sprite>::Property properties[] =
+ {
+     { "x", GetX, SetX },
+     { "handle", GetHandle, nullptr },           // Read only
+ };
+ PropertyDispatcher<Sprite>::Bind(L, metaTableIdx, methodTableIdx, properties, 2);
+ */
+template <typename T>
+struct PropertyDispatcher
+{
+    typedef void (*Getter)(lua_State* L, const T& object);              // Pushes the value
+    typedef void (*Setter)(lua_State* L, T& object, int valueIdx);
+
+    struct Property
+    {
+        const char* m_name;         // Interned copy once bound
+        Getter m_get;
+        Setter m_set;
+    };
+
+    // Lua only interns strings up to LUAI_MAXSHORTLEN (40) characters
+    static constexpr size_t MAX_NAME_LENGTH = 40;
+
+    // Full user datum up-value
+    struct Dispatch
+    {
+        int m_numProperties;
+        Property m_properties[1];   // m_numProperties of them
+    };
+
+    // Sets __index and __newindex on the metatable. Up-values: 1 dispatch, 2 method table, 3 metatable, 4... property names
+    static void Bind(lua_State* L, int metaTableIdx, int methodTableIdx, const Property* properties, int numProperties)
+    {
+        metaTableIdx = lua_absindex(L, metaTableIdx);
+        methodTableIdx = lua_absindex(L, methodTableIdx);
+
+        // A longer name wouldn't be interned, so its property would never be found
+        for (int i = 0; i < numProperties; i++)
+        {
+            if (strlen(properties[i].m_name) > MAX_NAME_LENGTH)
+            {
+                luaL_error(L, "property name '%s' is longer than %d characters", properties[i].m_name, (int) MAX_NAME_LENGTH);
+            }
+        }
+
+        size_t size = sizeof(Dispatch) + sizeof(Property) * (numProperties > 0 ? numProperties - 1 : 0);
+        Dispatch* dispatch = (Dispatch*) lua_newuserdata(L, size);
+        int dispatchIdx = lua_gettop(L);
+        dispatch->m_numProperties = numProperties;
+
+        const char* metaMethods[] = { "__index", "__newindex" };
+        lua_CFunction functions[] = { Index, NewIndex };
+        for (int m = 0; m < 2; m++)
+        {
+            lua_pushvalue(L, dispatchIdx);
+            lua_pushvalue(L, methodTableIdx);
+            lua_pushvalue(L, metaTableIdx);
+            for (int i = 0; i < numProperties; i++)
+            {
+                const char* interned = lua_pushstring(L, properties[i].m_name);     // Kept alive by the closures
+                if (m == 0)
+                {
+                    dispatch->m_properties[i] = properties[i];
+                    dispatch->m_properties[i].m_name = interned;
+                }
+                assert(dispatch->m_properties[i].m_name == interned);
+            }
+            lua_pushcclosure(L, functions[m], 3 + numProperties);
+            lua_setfield(L, metaTableIdx, metaMethods[m]);
+        }
+        lua_pop(L, 1);
+    }
+
+    // Property with this key, nullptr if the key isn't a property name
+    static const Property* Find(lua_State* L, int keyIdx)
+    {
+        if (lua_type(L, keyIdx) != LUA_TSTRING)
+        {
+            return nullptr;
+        }
+        const Dispatch& dispatch = *(const Dispatch*) lua_touserdata(L, lua_upvalueindex(1));
+        const char* key = lua_tostring(L, keyIdx);
+        for (int i = 0; i < dispatch.m_numProperties; i++)
+        {
+            if (dispatch.m_properties[i].m_name == key)
+            {
+                return &dispatch.m_properties[i];
+            }
+        }
+        return nullptr;
+    }
+
+    // Argument 1, checked against the metatable (up-value 3)
+    static T& CheckObject(lua_State* L)
+    {
+        if (lua_type(L, 1) != LUA_TUSERDATA || lua_getmetatable(L, 1) == 0)
+        {
+            luaL_argerror(L, 1, "expected an object (did you use '.' instead of ':'?)");
+        }
+        if (!lua_rawequal(L, -1, lua_upvalueindex(3)))
+        {
+            luaL_argerror(L, 1, "object is of the wrong type");
+        }
+        lua_pop(L, 1);
+        return *(T*) lua_touserdata(L, 1);
+    }
+
+    static int Index(lua_State* L)
+    {
+        // 1 = user datum, 2 = key
+        const T& object = CheckObject(L);
+        if (const Property* property = Find(L, 2))
+        {
+            property->m_get(L, object);
+            return 1;
+        }
+
+        // Dynamic fields, if any were ever set
+        if (lua_getuservalue(L, 1) == LUA_TTABLE)
+        {
+            lua_pushvalue(L, 2);
+            if (lua_rawget(L, -2) != LUA_TNIL)
+            {
+                return 1;
+            }
+            lua_pop(L, 2);
+        }
+        else
+        {
+            lua_pop(L, 1);
+        }
+
+        // Methods
+        lua_pushvalue(L, 2);
+        lua_rawget(L, lua_upvalueindex(2));
+        return 1;
+    }
+
+    static int NewIndex(lua_State* L)
+    {
+        // 1 = user datum, 2 = key, 3 = value
+        T& object = CheckObject(L);
+        if (const Property* property = Find(L, 2))
+        {
+            if (property->m_set == nullptr)
+            {
+                return luaL_error(L, "'%s' is read only", property->m_name);
+            }
+            property->m_set(L, object, 3);
+            return 0;
+        }
+
+        // User value table, created on the first dynamic field
+        if (lua_getuservalue(L, 1) != LUA_TTABLE)
+        {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_setuservalue(L, 1);
+        }
+        lua_pushvalue(L, 2);
+        lua_pushvalue(L, 3);
+        lua_rawset(L, -3);
+        return 0;
+    }
+};
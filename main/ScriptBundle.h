@@ -0,0 +1,339 @@
+#pragma once
+
+#include "ScriptCache.h"
+#include "lua.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string.h>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+ Many precompiled scripts in one file, memory-mapped and loaded straight out of the mapping.
+
+ [ BundleHeader | BundleEntry x numScripts (sorted by name) | names (NUL terminated) | bytecode chunks ]
+ Every offset is from the start of the file.
+
+ Opening a bundle maps it and checks the header, nothing is read or copied. Load() finds the script
+ with a binary search over the index and hands lua the chunk through BufferReader, a slice of the mapping:
+ no file read, no copy, no parsing. Pages the program never touches are never read from disk.
+ Only load bundles your own build step produced: lua_load does not verify bytecode, and crafted bytecode
+ can corrupt memory. Never load one downloaded, or writable by anyone else.
+
+ ScriptBundleWriter writer;
+ writer.Add(L, "Pythagoras", PYTHAGORAS_SOURCE);
+ writer.Write("scripts.bundle");
+
+ ScriptBundle bundle("scripts.bundle");
+ bundle.Load(L, "Pythagoras");       // Pushes the chunk, like luaL_loadbuffer
+ */
+struct BundleHeader
+{
+    static constexpr uint32_t MAGIC = 0x4C444E42;       // "BNDL"
+    static constexpr uint32_t VERSION = 1;
+
+    uint32_t m_magic;
+    uint32_t m_version;
+    uint32_t m_numScripts;
+    uint32_t m_reserved;
+};
+
+struct BundleEntry
+{
+    uint64_t m_chunkOffset;
+    uint64_t m_chunkSize;
+    uint32_t m_nameOffset;
+    uint32_t m_nameLength;      // Without the NUL
+};
+
+struct ScriptBundleWriter
+{
+    struct Script
+    {
+        std::string m_name;
+        std::string m_bytecode;
+    };
+
+    std::vector<Script> m_scripts;
+
+    // Compiles the source with L (nothing is left on its stack). Returns the lua status, the error is printed
+    int Add(lua_State* L, const char* name, const char* source, bool stripDebugInfo = false)
+    {
+        int status = BufferReader::Load(L, source, strlen(source), name, "t");
+        if (status != LUA_OK)
+        {
+            printf("Error: %s\n", lua_tostring(L, -1));
+            lua_pop(L, 1);
+            return status;
+        }
+        Script script;
+        script.m_name = name;
+        lua_dump(L, ScriptCache::DumpWriter, &script.m_bytecode, stripDebugInfo ? 1 : 0);
+        lua_pop(L, 1);
+        m_scripts.push_back(std::move(script));
+        return LUA_OK;
+    }
+
+    bool Write(const char* path)
+    {
+        std::sort(m_scripts.begin(), m_scripts.end(), [](const Script& a, const Script& b) { return a.m_name < b.m_name; });
+
+        BundleHeader header = { BundleHeader::MAGIC, BundleHeader::VERSION, (uint32_t) m_scripts.size(), 0 };
+        std::vector<BundleEntry> entries(m_scripts.size());
+
+        // Names, then chunks
+        uint64_t offset = sizeof(BundleHeader) + sizeof(BundleEntry) * entries.size();
+        for (size_t i = 0; i < m_scripts.size(); i++)
+        {
+            entries[i].m_nameOffset = (uint32_t) offset;
+            entries[i].m_nameLength = (uint32_t) m_scripts[i].m_name.size();
+            offset += m_scripts[i].m_name.size() + 1;
+        }
+        for (size_t i = 0; i < m_scripts.size(); i++)
+        {
+            entries[i].m_chunkOffset = offset;
+            entries[i].m_chunkSize = m_scripts[i].m_bytecode.size();
+            offset += m_scripts[i].m_bytecode.size();
+        }
+
+        FILE* file = fopen(path, "wb");
+        if (file == nullptr)
+        {
+            return false;
+        }
+        fwrite(&header, sizeof(header), 1, file);
+        fwrite(entries.data(), sizeof(BundleEntry), entries.size(), file);
+        for (const Script& script : m_scripts)
+        {
+            fwrite(script.m_name.c_str(), 1, script.m_name.size() + 1, file);
+        }
+        for (const Script& script : m_scripts)
+        {
+            fwrite(script.m_bytecode.data(), 1, script.m_bytecode.size(), file);
+        }
+        return fclose(file) == 0;
+    }
+};
+
+struct ScriptBundle
+{
+    const char* m_data;
+    size_t m_size;
+#if defined(_WIN32)
+    HANDLE m_file;
+    HANDLE m_mapping;
+#endif
+
+    ScriptBundle(const char* path)
+    : m_data(nullptr),
+    m_size(0)
+    {
+        Map(path);
+        if (m_data && !IsValid())
+        {
+            printf("'%s' is not a script bundle\n", path);
+            Unmap();
+        }
+    }
+
+    ~ScriptBundle()
+    {
+        Unmap();
+    }
+
+    ScriptBundle(const ScriptBundle&) = delete;
+    ScriptBundle& operator=(const ScriptBundle&) = delete;
+
+#if defined(_WIN32)
+    void Map(const char* path)
+    {
+        m_mapping = nullptr;
+        m_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE)
+        {
+            return;
+        }
+        LARGE_INTEGER size;
+        if (GetFileSizeEx(m_file, &size) && size.QuadPart > 0)
+        {
+            m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (m_mapping)
+            {
+                m_data = (const char*) MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+                m_size = m_data ? (size_t) size.QuadPart : 0;
+            }
+        }
+    }
+
+    void Unmap()
+    {
+        if (m_data)
+        {
+            UnmapViewOfFile(m_data);
+        }
+        if (m_mapping)
+        {
+            CloseHandle(m_mapping);
+        }
+        if (m_file != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(m_file);
+        }
+        m_data = nullptr;
+        m_size = 0;
+        m_mapping = nullptr;
+        m_file = INVALID_HANDLE_VALUE;
+    }
+#else
+    void Map(const char* path)
+    {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            return;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0)
+        {
+            void* data = mmap(nullptr, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED)
+            {
+                m_data = (const char*) data;
+                m_size = (size_t) info.st_size;
+            }
+        }
+        close(fd);      // The mapping stays valid
+    }
+
+    void Unmap()
+    {
+        if (m_data)
+        {
+            munmap((void*) m_data, m_size);
+        }
+        m_data = nullptr;
+        m_size = 0;
+    }
+#endif
+
+    bool IsOpen() const
+    {
+        return m_data != nullptr;
+    }
+
+    const BundleHeader& Header() const
+    {
+        return *(const BundleHeader*) m_data;
+    }
+
+    const BundleEntry* Entries() const
+    {
+        return (const BundleEntry*) (m_data + sizeof(BundleHeader));
+    }
+
+    int NumScripts() const
+    {
+        return IsOpen() ? (int) Header().m_numScripts : 0;
+    }
+
+    const char* Name(const BundleEntry& entry) const
+    {
+        return m_data + entry.m_nameOffset;
+    }
+
+    // Header and index fit in the file, every name and chunk too
+    bool IsValid() const
+    {
+        if (m_size < sizeof(BundleHeader) || Header().m_magic != BundleHeader::MAGIC || Header().m_version != BundleHeader::VERSION)
+        {
+            return false;
+        }
+        uint64_t numScripts = Header().m_numScripts;
+        if ((m_size - sizeof(BundleHeader)) / sizeof(BundleEntry) < numScripts)
+        {
+            return false;
+        }
+        for (uint64_t i = 0; i < numScripts; i++)
+        {
+            const BundleEntry& entry = Entries()[i];
+            if ((uint64_t) entry.m_nameOffset + entry.m_nameLength >= m_size || m_data[entry.m_nameOffset + entry.m_nameLength] != '\0' ||
+                entry.m_chunkOffset > m_size || entry.m_chunkSize > m_size - entry.m_chunkOffset)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Binary search over the sorted index, nullptr if the bundle has no such script
+    const BundleEntry* Find(const char* name) const
+    {
+        const BundleEntry* first = Entries();
+        const BundleEntry* last = first + NumScripts();
+        while (first < last)
+        {
+            const BundleEntry* middle = first + (last - first) / 2;
+            int order = strcmp(Name(*middle), name);
+            if (order == 0)
+            {
+                return middle;
+            }
+            if (order < 0)
+            {
+                first = middle + 1;
+            }
+            else
+            {
+                last = middle;
+            }
+        }
+        return nullptr;
+    }
+
+    // Pushes the chunk of the script (or an error message), returns a lua status code
+    int Load(lua_State* L, const char* name) const
+    {
+        const BundleEntry* entry = Find(name);
+        if (entry == nullptr)
+        {
+            lua_pushfstring(L, "script '%s' is not in the bundle", name);
+            return LUA_ERRFILE;
+        }
+        return BufferReader::Load(L, m_data + entry->m_chunkOffset, (size_t) entry->m_chunkSize, Name(*entry), "b");
+    }
+
+    // Loads and runs every script of the bundle, returns the first error
+    int RunAll(lua_State* L) const
+    {
+        for (int i = 0; i < NumScripts(); i++)
+        {
+            const BundleEntry& entry = Entries()[i];
+            int status = BufferReader::Load(L, m_data + entry.m_chunkOffset, (size_t) entry.m_chunkSize, Name(entry), "b");
+            if (status == LUA_OK)
+            {
+                status = lua_pcall(L, 0, 0, 0);
+            }
+            if (status != LUA_OK)
+            {
+                return status;
+            }
+        }
+        return LUA_OK;
+    }
+};
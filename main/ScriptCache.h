@@ -0,0 +1,209 @@
+#pragma once
+
+#include "lua.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string.h>
+#include <unordered_map>
+
+/*
+ lua_Reader handing lua one memory block, without copying it.
+ lua_load asks again after the block: the second call returns nullptr (end of chunk).
+ */
+struct BufferReader
+{
+    const char* m_data;
+    size_t m_size;
+
+    BufferReader(const char* data, size_t size)
+    : m_data(data),
+    m_size(size)
+    { }
+
+    static const char* Read(lua_State* /*L*/, void* ud, size_t* size)
+    {
+        BufferReader* reader = static_cast<BufferReader*>(ud);
+        *size = reader->m_size;
+        reader->m_size = 0;
+        return *size ? reader->m_data : nullptr;
+    }
+
+    // lua_load from memory: mode is "t" (source), "b" (bytecode) or "bt"
+    static int Load(lua_State* L, const char* data, size_t size, const char* chunkName, const char* mode)
+    {
+        BufferReader reader(data, size);
+        return lua_load(L, BufferReader::Read, &reader, chunkName, mode);
+    }
+};
+
+/*
+ Compiles each script once. The bytecode (lua_dump) is kept in memory keyed by a hash of the source and
+ chunk name, every later load of the same source is a lua_load of the bytecode: no lexing, no parsing.
+ The chunk name is part of the key because the bytecode carries the name it was compiled with (error messages).
+
+ Optionally the bytecode is also written to a directory, so the next run of the program skips parsing too.
+ Only point that at a directory you trust: lua does not verify bytecode. Bytecode from another lua build
+ (version, number types) is rejected by lua_load and the script is compiled again.
+
+ ScriptCache cache;
+ cache.DoString(L, LUA_FILE, "=sprites");      // Compiles
+ cache.DoString(L2, LUA_FILE, "=sprites");     // Loads the bytecode
+ */
+struct ScriptCache
+{
+    struct Entry
+    {
+        size_t m_sourceLength;      // Guards against hash collisions, with the chunk name
+        std::string m_chunkName;
+        std::string m_bytecode;
+        double m_parseMs;           // What compiling the source cost
+    };
+
+    std::unordered_map<uint64_t, Entry> m_entries;
+    std::string m_directory;        // On-disk cache, empty: memory only
+    bool m_stripDebugInfo;          // Smaller bytecode, but errors lose their line numbers
+
+    // Counters
+    size_t m_hits;
+    size_t m_misses;
+    size_t m_diskHits;
+    double m_parseMsSaved;          // Sum of the parse time of every hit
+
+    ScriptCache(const char* directory = nullptr)
+    : m_directory(directory ? directory : ""),
+    m_stripDebugInfo(false),
+    m_hits(0),
+    m_misses(0),
+    m_diskHits(0),
+    m_parseMsSaved(0.0)
+    { }
+
+    // 64 bit FNV-1a, continues from hash to key on several strings
+    static uint64_t Hash(const char* data, size_t length, uint64_t hash = 14695981039346656037ull)
+    {
+        for (size_t i = 0; i < length; i++)
+        {
+            hash ^= (unsigned char) data[i];
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    static int DumpWriter(lua_State* /*L*/, const void* p, size_t size, void* ud)
+    {
+        static_cast<std::string*>(ud)->append(static_cast<const char*>(p), size);
+        return 0;
+    }
+
+    std::string DiskPath(uint64_t hash) const
+    {
+        char fileName[32];
+        snprintf(fileName, sizeof(fileName), "/%016llx.luac", (unsigned long long) hash);
+        return m_directory + fileName;
+    }
+
+    // File: source length (uint64_t), chunk name length (uint64_t), chunk name, bytecode.
+    // Like in memory, a file whose source length or chunk name don't match is a hash collision, not a hit
+    bool ReadFromDisk(uint64_t hash, Entry& entry) const
+    {
+        FILE* file = fopen(DiskPath(hash).c_str(), "rb");
+        if (file == nullptr)
+        {
+            return false;
+        }
+        uint64_t header[2];
+        std::string chunkName(entry.m_chunkName.size(), '\0');
+        if (fread(header, sizeof(header), 1, file) != 1 || header[0] != entry.m_sourceLength || header[1] != chunkName.size() ||
+            (!chunkName.empty() && fread(&chunkName[0], 1, chunkName.size(), file) != chunkName.size()) || chunkName != entry.m_chunkName)
+        {
+            fclose(file);
+            return false;
+        }
+        char buffer[4096];
+        size_t read;
+        while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        {
+            entry.m_bytecode.append(buffer, read);
+        }
+        fclose(file);
+        return !entry.m_bytecode.empty();
+    }
+
+    void WriteToDisk(uint64_t hash, const Entry& entry) const
+    {
+        FILE* file = fopen(DiskPath(hash).c_str(), "wb");
+        if (file)
+        {
+            uint64_t header[2] = { entry.m_sourceLength, entry.m_chunkName.size() };
+            fwrite(header, sizeof(header), 1, file);
+            fwrite(entry.m_chunkName.data(), 1, entry.m_chunkName.size(), file);
+            fwrite(entry.m_bytecode.data(), 1, entry.m_bytecode.size(), file);
+            fclose(file);
+        }
+    }
+
+    // Like luaL_loadstring: pushes the compiled chunk (or an error message), returns a lua status code
+    int Load(lua_State* L, const char* source, const char* chunkName = "=script")
+    {
+        size_t length = strlen(source);
+        uint64_t hash = Hash(chunkName, strlen(chunkName), Hash(source, length));
+
+        auto found = m_entries.find(hash);
+        if (found != m_entries.end() && found->second.m_sourceLength == length && found->second.m_chunkName == chunkName)
+        {
+            const Entry& entry = found->second;
+            int status = BufferReader::Load(L, entry.m_bytecode.data(), entry.m_bytecode.size(), chunkName, "b");
+            if (status == LUA_OK)
+            {
+                m_hits++;
+                m_parseMsSaved += entry.m_parseMs;
+                return status;
+            }
+            lua_pop(L, 1);
+        }
+
+        // Compiled by an earlier run?
+        Entry entry;
+        entry.m_sourceLength = length;
+        entry.m_chunkName = chunkName;
+        entry.m_parseMs = 0.0;
+        if (!m_directory.empty() && ReadFromDisk(hash, entry))
+        {
+            if (BufferReader::Load(L, entry.m_bytecode.data(), entry.m_bytecode.size(), chunkName, "b") == LUA_OK)
+            {
+                m_diskHits++;
+                m_entries[hash] = std::move(entry);
+                return LUA_OK;
+            }
+            lua_pop(L, 1);
+            entry.m_bytecode.clear();
+        }
+
+        m_misses++;
+        auto start = std::chrono::high_resolution_clock::now();
+        int status = BufferReader::Load(L, source, length, chunkName, "t");
+        auto end = std::chrono::high_resolution_clock::now();
+        if (status != LUA_OK)
+        {
+            return status;
+        }
+        entry.m_parseMs = std::chrono::duration<double, std::milli>(end - start).count();
+
+        lua_dump(L, DumpWriter, &entry.m_bytecode, m_stripDebugInfo ? 1 : 0);
+        if (!m_directory.empty())
+        {
+            WriteToDisk(hash, entry);
+        }
+        m_entries[hash] = std::move(entry);
+        return LUA_OK;
+    }
+
+    // Like luaL_dostring
+    int DoString(lua_State* L, const char* source, const char* chunkName = "=script")
+    {
+        int status = Load(L, source, chunkName);
+        return status != LUA_OK ? status : lua_pcall(L, 0, LUA_MULTRET, 0);
+    }
+};
@@ -0,0 +1,375 @@
+#pragma once
+
+#include "StatePool.h"
+#include "lua.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ Runs independent script jobs on N worker threads.
+
+ Every worker builds its own StatePool on its own thread: pre-bound states (the setup function runs once
+ per state), restored to their golden image after every job. A job is a chunk (source or bytecode) plus
+ arguments, run with lua_pcall; its return values come back through a std::future.
+
+ Every worker has its own deque of jobs. A worker takes its newest job (LIFO, still warm in cache), an idle
+ worker steals the oldest job of another worker (FIFO, the one its owner will get to last).
+ Each deque has its own mutex, only held for a push or pop, so workers never wait on a single shared queue.
+ Jobs submitted from a worker thread go to that worker's deque, others are dealt round robin.
+
+ ScriptExecutor executor(4, 1024 * 256, [](lua_State* L) { BindGlobalMethods(L, "Global"); });
+ std::future<ScriptResult> result = executor.Submit("local a, b = ... return Global.Mul(a, b)", { 3, 4 });
+ result.get().m_values[0].m_number;          // 12
+ */
+
+// Value copied into and out of a job's lua_State (lua values can't cross states).
+// Only nil, booleans, numbers and strings, anything else comes back as nil
+struct ScriptValue
+{
+    int m_type;
+    bool m_boolean;
+    bool m_isInteger;
+    lua_Integer m_integer;
+    lua_Number m_number;
+    std::string m_string;
+
+    ScriptValue()
+    : m_type(LUA_TNIL), m_boolean(false), m_isInteger(false), m_integer(0), m_number(0)
+    { }
+
+    ScriptValue(bool value)
+    : ScriptValue()
+    {
+        m_type = LUA_TBOOLEAN;
+        m_boolean = value;
+    }
+
+    ScriptValue(lua_Integer value)
+    : ScriptValue()
+    {
+        m_type = LUA_TNUMBER;
+        m_isInteger = true;
+        m_integer = value;
+        m_number = (lua_Number) value;
+    }
+
+    ScriptValue(int value)
+    : ScriptValue((lua_Integer) value)
+    { }
+
+    ScriptValue(lua_Number value)
+    : ScriptValue()
+    {
+        m_type = LUA_TNUMBER;
+        m_number = value;
+    }
+
+    ScriptValue(std::string value)
+    : ScriptValue()
+    {
+        m_type = LUA_TSTRING;
+        m_string = std::move(value);
+    }
+
+    ScriptValue(const char* value)
+    : ScriptValue(std::string(value))
+    { }
+
+    void Push(lua_State* L) const
+    {
+        switch (m_type)
+        {
+            case LUA_TBOOLEAN:
+                lua_pushboolean(L, m_boolean);
+                break;
+            case LUA_TNUMBER:
+                if (m_isInteger)
+                {
+                    lua_pushinteger(L, m_integer);
+                }
+                else
+                {
+                    lua_pushnumber(L, m_number);
+                }
+                break;
+            case LUA_TSTRING:
+                lua_pushlstring(L, m_string.data(), m_string.size());
+                break;
+            default:
+                lua_pushnil(L);
+                break;
+        }
+    }
+
+    static ScriptValue FromStack(lua_State* L, int idx)
+    {
+        switch (lua_type(L, idx))
+        {
+            case LUA_TBOOLEAN:
+                return ScriptValue(lua_toboolean(L, idx) != 0);
+            case LUA_TNUMBER:
+                if (lua_isinteger(L, idx))
+                {
+                    return ScriptValue(lua_tointeger(L, idx));
+                }
+                return ScriptValue(lua_tonumber(L, idx));
+            case LUA_TSTRING:
+            {
+                size_t length = 0;
+                const char* string = lua_tolstring(L, idx, &length);
+                return ScriptValue(std::string(string, length));
+            }
+            default:
+                return ScriptValue();
+        }
+    }
+};
+
+struct ScriptResult
+{
+    int m_status;                       // LUA_OK or the lua error code
+    std::string m_error;
+    std::vector<ScriptValue> m_values;  // Everything the chunk returned
+};
+
+struct ScriptExecutor
+{
+    struct Job
+    {
+        std::string m_chunk;
+        std::string m_chunkName;
+        std::vector<ScriptValue> m_args;
+        std::promise<ScriptResult> m_promise;
+    };
+
+    struct Worker
+    {
+        const ScriptExecutor* m_executor;
+        size_t m_index;
+        std::thread m_thread;
+
+        std::mutex m_mutex;
+        std::deque<std::unique_ptr<Job>> m_jobs;
+
+        // Stats
+        std::atomic<size_t> m_jobsRun;
+        std::atomic<size_t> m_jobsStolen;
+
+        Worker(const ScriptExecutor* executor, size_t index)
+        : m_executor(executor),
+        m_index(index),
+        m_jobsRun(0),
+        m_jobsStolen(0)
+        { }
+    };
+
+    StatePool::SetupFunction m_setup;
+    size_t m_statesPerWorker;
+    size_t m_arenaSizePerState;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+
+    // Submitted and not yet taken. Counted before the push, so it never misses a job sitting in a deque
+    std::atomic<size_t> m_pendingJobs;
+    std::atomic<size_t> m_nextWorker;
+
+    std::mutex m_wakeMutex;
+    std::condition_variable m_wake;
+    bool m_stopping;
+
+    ScriptExecutor(size_t numWorkers, size_t arenaSizePerState, StatePool::SetupFunction setup, size_t statesPerWorker = 1)
+    : m_setup(setup),
+    m_statesPerWorker(statesPerWorker),
+    m_arenaSizePerState(arenaSizePerState),
+    m_pendingJobs(0),
+    m_nextWorker(0),
+    m_stopping(false)
+    {
+        numWorkers = numWorkers ? numWorkers : 1;
+        for (size_t i = 0; i < numWorkers; i++)
+        {
+            m_workers.emplace_back(new Worker(this, i));
+        }
+        for (auto& worker : m_workers)
+        {
+            worker->m_thread = std::thread(&ScriptExecutor::WorkerLoop, this, worker.get());
+        }
+    }
+
+    // Finishes every job already submitted
+    ~ScriptExecutor()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_wakeMutex);
+            m_stopping = true;
+        }
+        m_wake.notify_all();
+        for (auto& worker : m_workers)
+        {
+            worker->m_thread.join();
+        }
+    }
+
+    ScriptExecutor(const ScriptExecutor&) = delete;
+    ScriptExecutor& operator=(const ScriptExecutor&) = delete;
+
+    static Worker*& CurrentWorker()
+    {
+        static thread_local Worker* tl_worker = nullptr;
+        return tl_worker;
+    }
+
+    // The chunk gets the arguments as '...'
+    std::future<ScriptResult> Submit(std::string chunk, std::vector<ScriptValue> args = std::vector<ScriptValue>(), std::string chunkName = "=job")
+    {
+        std::unique_ptr<Job> job(new Job());
+        job->m_chunk = std::move(chunk);
+        job->m_chunkName = std::move(chunkName);
+        job->m_args = std::move(args);
+        std::future<ScriptResult> result = job->m_promise.get_future();
+
+        Worker* worker = CurrentWorker();
+        if (worker == nullptr || worker->m_executor != this)
+        {
+            worker = m_workers[m_nextWorker++ % m_workers.size()].get();
+        }
+
+        m_pendingJobs++;
+        {
+            std::lock_guard<std::mutex> lock(worker->m_mutex);
+            worker->m_jobs.push_back(std::move(job));
+        }
+        {
+            // Taking the lock orders this with a worker about to wait
+            std::lock_guard<std::mutex> lock(m_wakeMutex);
+        }
+        m_wake.notify_one();
+        return result;
+    }
+
+    // Own newest job, else the oldest job of another worker
+    std::unique_ptr<Job> TakeJob(Worker& self)
+    {
+        std::unique_ptr<Job> job;
+        {
+            std::lock_guard<std::mutex> lock(self.m_mutex);
+            if (!self.m_jobs.empty())
+            {
+                job = std::move(self.m_jobs.back());
+                self.m_jobs.pop_back();
+                return job;
+            }
+        }
+
+        for (size_t i = 1; i < m_workers.size(); i++)
+        {
+            Worker& victim = *m_workers[(self.m_index + i) % m_workers.size()];
+            std::lock_guard<std::mutex> lock(victim.m_mutex);
+            if (!victim.m_jobs.empty())
+            {
+                job = std::move(victim.m_jobs.front());
+                victim.m_jobs.pop_front();
+                self.m_jobsStolen++;
+                return job;
+            }
+        }
+        return job;
+    }
+
+    void WorkerLoop(Worker* self)
+    {
+        CurrentWorker() = self;
+
+        // Built on this thread, only ever used by it
+        StatePool states(m_statesPerWorker, m_arenaSizePerState, m_setup);
+
+        for (;;)
+        {
+            std::unique_ptr<Job> job = TakeJob(*self);
+            if (job)
+            {
+                m_pendingJobs--;
+                Run(states, *job);
+                self->m_jobsRun++;
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(m_wakeMutex);
+            if (m_stopping && m_pendingJobs == 0)
+            {
+                break;
+            }
+            m_wake.wait(lock, [this]() { return m_stopping || m_pendingJobs > 0; });
+        }
+
+        CurrentWorker() = nullptr;
+    }
+
+    static void Run(StatePool& states, Job& job)
+    {
+        lua_State* L = states.Acquire();
+        ScriptResult result;
+
+        result.m_status = luaL_loadbuffer(L, job.m_chunk.data(), job.m_chunk.size(), job.m_chunkName.c_str());
+        if (result.m_status == LUA_OK)
+        {
+            if (!lua_checkstack(L, (int) job.m_args.size()))
+            {
+                lua_pushstring(L, "too many arguments");
+                result.m_status = LUA_ERRRUN;
+            }
+            else
+            {
+                for (const ScriptValue& arg : job.m_args)
+                {
+                    arg.Push(L);
+                }
+                result.m_status = lua_pcall(L, (int) job.m_args.size(), LUA_MULTRET, 0);
+            }
+        }
+
+        if (result.m_status == LUA_OK)
+        {
+            int numResults = lua_gettop(L);
+            result.m_values.reserve(numResults);
+            for (int i = 1; i <= numResults; i++)
+            {
+                result.m_values.push_back(ScriptValue::FromStack(L, i));
+            }
+        }
+        else
+        {
+            const char* error = lua_tostring(L, -1);
+            result.m_error = error ? error : "(error object is not a string)";
+        }
+
+        states.Release(L);      // Back to the golden state for the next job
+        job.m_promise.set_value(std::move(result));
+    }
+
+    size_t JobsRun() const
+    {
+        size_t total = 0;
+        for (auto& worker : m_workers)
+        {
+            total += worker->m_jobsRun;
+        }
+        return total;
+    }
+
+    size_t JobsStolen() const
+    {
+        size_t total = 0;
+        for (auto& worker : m_workers)
+        {
+            total += worker->m_jobsStolen;
+        }
+        return total;
+    }
+};
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/*
+ Slot map: values stored densely (iteration is a plain array walk), reached through generational handles.
+ Insert, Remove and Get are O(1): removal swaps the last value into the hole, no search and no memmove.
+
+ A handle is the slot index (low 32 bits) and the slot generation (high 32 bits). Removing a value bumps the
+ generation of its slot, so handles to removed values (e.g. kept by a script) are detected instead of
+ reaching whatever value reuses the slot. Handles fit in a lua_Integer.
+ */
+template <typename T>
+struct SlotMap
+{
+    typedef uint64_t Handle;
+    static constexpr Handle INVALID_HANDLE = 0;        // Generations start at 1
+    static constexpr uint32_t NO_SLOT = 0xFFFFFFFF;
+
+    struct Slot
+    {
+        uint32_t m_denseIndex;      // Next free slot while the slot is free
+        uint32_t m_generation;
+    };
+
+    std::vector<T> m_values;
+    std::vector<uint32_t> m_valueSlots;     // Slot of each value, to fix up the slot of the value moved by Remove
+    std::vector<Slot> m_slots;
+    uint32_t m_freeSlots;
+
+    SlotMap()
+    : m_freeSlots(NO_SLOT)
+    { }
+
+    static Handle MakeHandle(uint32_t slot, uint32_t generation)
+    {
+        return (Handle(generation) << 32) | slot;
+    }
+
+    size_t Size() const
+    {
+        return m_values.size();
+    }
+
+    Handle Insert(const T& value)
+    {
+        uint32_t slot = m_freeSlots;
+        if (slot != NO_SLOT)
+        {
+            m_freeSlots = m_slots[slot].m_denseIndex;
+        }
+        else
+        {
+            slot = (uint32_t) m_slots.size();
+            m_slots.push_back({ 0, 1 });
+        }
+
+        m_slots[slot].m_denseIndex = (uint32_t) m_values.size();
+        m_values.push_back(value);
+        m_valueSlots.push_back(slot);
+        return MakeHandle(slot, m_slots[slot].m_generation);
+    }
+
+    // nullptr for handles never given out, or whose value was removed
+    T* Get(Handle handle)
+    {
+        uint32_t slot = (uint32_t) handle;
+        uint32_t generation = (uint32_t) (handle >> 32);
+        if (slot >= m_slots.size() || m_slots[slot].m_generation != generation)
+        {
+            return nullptr;
+        }
+        return &m_values[m_slots[slot].m_denseIndex];
+    }
+
+    // False if the handle is stale
+    bool Remove(Handle handle)
+    {
+        if (Get(handle) == nullptr)
+        {
+            return false;
+        }
+
+        uint32_t slot = (uint32_t) handle;
+        uint32_t hole = m_slots[slot].m_denseIndex;
+        uint32_t last = (uint32_t) m_values.size() - 1;
+
+        // Swap remove
+        if (hole != last)
+        {
+            m_values[hole] = std::move(m_values[last]);
+            m_valueSlots[hole] = m_valueSlots[last];
+            m_slots[m_valueSlots[hole]].m_denseIndex = hole;
+        }
+        m_values.pop_back();
+        m_valueSlots.pop_back();
+
+        // Invalidate outstanding handles, never use generation 0
+        if (++m_slots[slot].m_generation == 0)
+        {
+            m_slots[slot].m_generation = 1;
+        }
+        m_slots[slot].m_denseIndex = m_freeSlots;
+        m_freeSlots = slot;
+        return true;
+    }
+
+    // Iterates the values (in no particular order)
+    typename std::vector<T>::iterator begin()
+    {
+        return m_values.begin();
+    }
+
+    typename std::vector<T>::iterator end()
+    {
+        return m_values.end();
+    }
+};
@@ -0,0 +1,168 @@
+#pragma once
+
+#include "lua.hpp"
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define SPRITE_SYSTEM_AVX 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SPRITE_SYSTEM_SSE 1
+#endif
+
+/*
+ Every sprite of the game in one place, as a structure of arrays: x, y, velocity x, velocity y each in their own
+ contiguous array. Step(dt) moves them all with SIMD (AVX when compiled with it, see LUA_TUTORIAL_AVX, SSE otherwise).
+
+ Lua never owns a sprite: a sprite handle is a plain integer index into the arrays,
+ so there is no user datum, no metatable and no __gc per sprite.
+
+ local s = SpriteSystem.new(x, y, velX, velY)
+ SpriteSystem.SetVelocity(s, 1, 0)
+ SpriteSystem.Step(dt)
+ local x, y = SpriteSystem.Position(s)
+ */
+struct SpriteSystem
+{
+    std::vector<float> m_x;
+    std::vector<float> m_y;
+    std::vector<float> m_velX;
+    std::vector<float> m_velY;
+
+    int Count() const
+    {
+        return (int) m_x.size();
+    }
+
+    void Reserve(int numSprites)
+    {
+        m_x.reserve(numSprites);
+        m_y.reserve(numSprites);
+        m_velX.reserve(numSprites);
+        m_velY.reserve(numSprites);
+    }
+
+    // Returns the handle of the new sprite
+    int Create(float x, float y, float velX, float velY)
+    {
+        m_x.push_back(x);
+        m_y.push_back(y);
+        m_velX.push_back(velX);
+        m_velY.push_back(velY);
+        return Count() - 1;
+    }
+
+    void Clear()
+    {
+        m_x.clear();
+        m_y.clear();
+        m_velX.clear();
+        m_velY.clear();
+    }
+
+    // position += velocity * dt, for one array
+    static void Integrate(float* position, const float* velocity, int count, float dt)
+    {
+        int i = 0;
+#if defined(SPRITE_SYSTEM_AVX)
+        __m256 dt8 = _mm256_set1_ps(dt);
+        for (; i + 8 <= count; i += 8)
+        {
+            __m256 p = _mm256_loadu_ps(position + i);
+            __m256 v = _mm256_loadu_ps(velocity + i);
+            _mm256_storeu_ps(position + i, _mm256_add_ps(p, _mm256_mul_ps(v, dt8)));
+        }
+#elif defined(SPRITE_SYSTEM_SSE)
+        __m128 dt4 = _mm_set1_ps(dt);
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128 p = _mm_loadu_ps(position + i);
+            __m128 v = _mm_loadu_ps(velocity + i);
+            _mm_storeu_ps(position + i, _mm_add_ps(p, _mm_mul_ps(v, dt4)));
+        }
+#endif
+        // Remainder (everything without SIMD)
+        for (; i < count; i++)
+        {
+            position[i] += velocity[i] * dt;
+        }
+    }
+
+    void Step(float dt)
+    {
+        Integrate(m_x.data(), m_velX.data(), Count(), dt);
+        Integrate(m_y.data(), m_velY.data(), Count(), dt);
+    }
+
+    // ---- Lua binding ----
+
+    static SpriteSystem* Self(lua_State* L)
+    {
+        return (SpriteSystem*) lua_touserdata(L, lua_upvalueindex(1));
+    }
+
+    // Handles are 0 based indices
+    static int CheckHandle(lua_State* L, SpriteSystem* self, int idx)
+    {
+        lua_Integer handle = luaL_checkinteger(L, idx);
+        luaL_argcheck(L, handle >= 0 && handle < self->Count(), idx, "invalid sprite handle");
+        return (int) handle;
+    }
+
+    static int LuaNew(lua_State* L)
+    {
+        SpriteSystem* self = Self(L);
+        lua_pushinteger(L, self->Create((float) luaL_optnumber(L, 1, 0), (float) luaL_optnumber(L, 2, 0),
+                                        (float) luaL_optnumber(L, 3, 0), (float) luaL_optnumber(L, 4, 0)));
+        return 1;
+    }
+
+    static int LuaSetVelocity(lua_State* L)
+    {
+        SpriteSystem* self = Self(L);
+        int handle = CheckHandle(L, self, 1);
+        self->m_velX[handle] = (float) luaL_checknumber(L, 2);
+        self->m_velY[handle] = (float) luaL_checknumber(L, 3);
+        return 0;
+    }
+
+    static int LuaPosition(lua_State* L)
+    {
+        SpriteSystem* self = Self(L);
+        int handle = CheckHandle(L, self, 1);
+        lua_pushnumber(L, self->m_x[handle]);
+        lua_pushnumber(L, self->m_y[handle]);
+        return 2;
+    }
+
+    static int LuaStep(lua_State* L)
+    {
+        Self(L)->Step((float) luaL_checknumber(L, 1));
+        return 0;
+    }
+
+    static int LuaCount(lua_State* L)
+    {
+        lua_pushinteger(L, Self(L)->Count());
+        return 1;
+    }
+
+    // Binds a global table of functions sharing this system as up-value
+    void RegisterLuaTable(lua_State* L, const char* name = "SpriteSystem")
+    {
+        const luaL_Reg functions[] =
+        {
+            { "new", LuaNew },
+            { "SetVelocity", LuaSetVelocity },
+            { "Position", LuaPosition },
+            { "Step", LuaStep },
+            { "Count", LuaCount },
+            { nullptr, nullptr }
+        };
+        lua_newtable(L);
+        lua_pushlightuserdata(L, this);
+        luaL_setfuncs(L, functions, 1);
+        lua_setglobal(L, name);
+    }
+};
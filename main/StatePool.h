@@ -0,0 +1,152 @@
+#pragma once
+
+#include "ArenaAllocator.h"
+#include "lua.hpp"
+#include <functional>
+#include <memory>
+#include <vector>
+
+/*
+ Pool of ready-to-run lua_States, for hosts that need a fully bound state per request.
+
+ Every slot owns a fixed arena. Its state is built once (lua_newstate + the setup function: bindings,
+ scripts...), this is the "golden" state. The used part of the arena and the allocator bookkeeping are then
+ snapshotted. Release() memcpy's the image back over the arena, restoring the golden state exactly:
+ no lua_newstate, no rebinding, no re-parsing. The arena never moves, so every pointer inside the image stays valid.
+
+ Things to know:
+ - Restoring throws away everything the request did, __gc is NOT called for objects the request created.
+ - If the state fell back onto the global allocator (arena too small), restoring would leak or dangle,
+   so that slot is closed and built cold again instead.
+ */
+struct StatePool
+{
+    typedef std::function<void(lua_State*)> SetupFunction;
+
+    struct Slot
+    {
+        std::vector<char> m_memory;
+        ArenaAllocator m_arena;
+        lua_State* m_state;
+        bool m_inUse;
+
+        // Golden state
+        std::vector<char> m_image;
+        ArenaAllocator::Snapshot m_snapshot;
+        size_t m_fallbacksAtSnapshot;
+        bool m_restorable;              // Golden state fitted in the arena
+
+        Slot(size_t arenaSize)
+        : m_memory(arenaSize),
+        m_arena(m_memory.data(), m_memory.data() + arenaSize),
+        m_state(nullptr),
+        m_inUse(false),
+        m_fallbacksAtSnapshot(0),
+        m_restorable(false)
+        { }
+    };
+
+    SetupFunction m_setup;
+    std::vector<std::unique_ptr<Slot>> m_slots;
+
+    // How slots were made ready again
+    size_t m_restores;
+    size_t m_coldBuilds;
+
+    StatePool(size_t numStates, size_t arenaSizePerState, SetupFunction setup)
+    : m_setup(setup),
+    m_restores(0),
+    m_coldBuilds(0)
+    {
+        for (size_t i = 0; i < numStates; i++)
+        {
+            m_slots.emplace_back(new Slot(arenaSizePerState));
+            BuildGolden(*m_slots.back());
+        }
+    }
+
+    ~StatePool()
+    {
+        for (auto& slot : m_slots)
+        {
+            lua_close(slot->m_state);
+        }
+    }
+
+    // Cold path: new state, setup, then snapshot the arena
+    void BuildGolden(Slot& slot)
+    {
+        if (slot.m_state)
+        {
+            lua_close(slot.m_state);
+        }
+
+        slot.m_arena.Reset();
+        size_t fallbacksBefore = slot.m_arena.m_counters.m_fallbacks;
+        slot.m_state = lua_newstate(StaticAllocator<ArenaAllocator>::l_alloc, &slot.m_arena);
+        m_setup(slot.m_state);
+        lua_settop(slot.m_state, 0);
+
+        // Don't keep the garbage from parsing in the image
+        lua_gc(slot.m_state, LUA_GCCOLLECT, 0);
+
+        // Golden state must live in the arena only
+        slot.m_fallbacksAtSnapshot = slot.m_arena.m_counters.m_fallbacks;
+        slot.m_restorable = slot.m_fallbacksAtSnapshot == fallbacksBefore;
+
+        char* begin = static_cast<char*>(slot.m_arena.m_begin);
+        slot.m_image.assign(begin, slot.m_arena.m_curr);
+        slot.m_snapshot = slot.m_arena.TakeSnapshot();
+        m_coldBuilds++;
+    }
+
+    bool CanRestore(const Slot& slot) const
+    {
+        return slot.m_restorable && slot.m_arena.m_counters.m_fallbacks == slot.m_fallbacksAtSnapshot;
+    }
+
+    // Hot path: put the golden image back over the arena
+    void Restore(Slot& slot)
+    {
+        memcpy(slot.m_arena.m_begin, slot.m_image.data(), slot.m_image.size());
+        slot.m_arena.RestoreSnapshot(slot.m_snapshot);
+        m_restores++;
+    }
+
+    // Ready state, nullptr when every state is in use
+    lua_State* Acquire()
+    {
+        for (auto& slot : m_slots)
+        {
+            if (!slot->m_inUse)
+            {
+                slot->m_inUse = true;
+                return slot->m_state;
+            }
+        }
+        return nullptr;
+    }
+
+    // Returns the state to the pool, in the same state it was built in
+    void Release(lua_State* L)
+    {
+        for (auto& slot : m_slots)
+        {
+            if (slot->m_state == L)
+            {
+                assert(slot->m_inUse);
+                if (CanRestore(*slot))
+                {
+                    Restore(*slot);
+                }
+                else
+                {
+                    BuildGolden(*slot);
+                }
+                slot->m_inUse = false;
+                return;
+            }
+        }
+        assert(false); // Not one of ours
+    }
+};
@@ -1,3 +1,5 @@
+#include "DirectBinding.h"
+#include "UserDatum.h"
 #include <rttr/registration>
 #include <cstdio>
 
@@ -67,8 +69,9 @@ RTTR_REGISTRATION
     rttr::registration::method("Add", &Add);
     rttr::registration::method("Mul", &Mul);
     
-    // Register Sprite class
+    // Register Sprite class, stored inline in its lua user datum (see UserDatum.h)
     rttr::registration::class_<Sprite>("Sprite")
+        (rttr::metadata(BindingMetadata::InlineLayout, InlineLayout::Of<Sprite>()))
         .constructor()
         .method("Move", &Sprite::Move)
         .method("Draw", &Sprite::Draw)
@@ -76,3 +79,19 @@ RTTR_REGISTRATION
         .property("y", &Sprite::y);
 }
 
+// The same functions, bound with compile-time thunks instead of RTTR (see DirectBinding.h)
+static DirectRegistration s_directBindings[] =
+{
+    { "HelloWorld", LUA_DIRECT_THUNK(HelloWorld) },
+    { "HelloWorld2", LUA_DIRECT_THUNK(HelloWorld2) },
+    { "Test", LUA_DIRECT_THUNK(Test) },
+    { "Add", LUA_DIRECT_THUNK(Add) },
+    { "Mul", LUA_DIRECT_THUNK(Mul) },
+};
+
+// Called from Sprite.batch without going through RTTR
+static DirectMethodRegistration s_directMethods[] =
+{
+    { "Sprite", "Move", LUA_DIRECT_METHOD(Sprite::Move) },
+    { "Sprite", "Draw", LUA_DIRECT_METHOD(Sprite::Draw) },
+};
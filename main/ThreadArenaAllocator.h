@@ -0,0 +1,254 @@
+#pragma once
+
+#include "ArenaAllocator.h"
+#include "lua.hpp"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ ArenaAllocator owned by a single worker thread.
+ The owner allocates and frees without any locking (its own pool, its own size classes).
+ Blocks freed by any other thread are pushed onto a lock-free remote free queue,
+ the owner puts them back into the arena the next time it allocates.
+ Allocations made by other threads come from the (thread-safe) global allocator.
+ */
+struct ThreadArena
+    : public IAllocator<ThreadArena>
+{
+    // Arena block freed by another thread, waiting for the owner to take it back
+    struct RemoteFree
+    {
+        RemoteFree* m_next;
+        size_t m_osize;
+    };
+    static_assert(sizeof(RemoteFree) <= ArenaAllocator::MIN_BLOCK_SIZE, "Every arena block must be able to hold a RemoteFree");
+
+    std::vector<char> m_memory;
+    ArenaAllocator m_arena;
+    std::atomic<std::thread::id> m_owner;          // No thread while the arena sits in its manager's free list
+
+    // Multiple producers push, only the owner takes the whole list (so no ABA problem)
+    std::atomic<RemoteFree*> m_remoteFrees;
+
+    ThreadArena(size_t sizeBytes)
+    : m_memory(sizeBytes),
+    m_arena(m_memory.data(), m_memory.data() + sizeBytes),
+    m_owner(std::this_thread::get_id()),
+    m_remoteFrees(nullptr)
+    { }
+
+    bool IsOwnerThread() const
+    {
+        return std::this_thread::get_id() == m_owner.load(std::memory_order_relaxed);
+    }
+
+    // Gives every block freed by other threads back to the arena (owner thread only)
+    void DrainRemoteFrees()
+    {
+        RemoteFree* block = m_remoteFrees.exchange(nullptr, std::memory_order_acquire);
+        while (block)
+        {
+            RemoteFree* next = block->m_next;
+            m_arena.ArenaAllocator::DeAllocate(block, block->m_osize);
+            block = next;
+        }
+    }
+
+    void PushRemoteFree(void* ptr, size_t osize)
+    {
+        RemoteFree* block = static_cast<RemoteFree*>(ptr);
+        block->m_osize = osize;
+        block->m_next = m_remoteFrees.load(std::memory_order_relaxed);
+        while (!m_remoteFrees.compare_exchange_weak(block->m_next, block, std::memory_order_release, std::memory_order_relaxed))
+        { }
+    }
+
+    void* Allocate(size_t sizeBytes) override
+    {
+        if (IsOwnerThread())
+        {
+            if (m_remoteFrees.load(std::memory_order_relaxed))
+            {
+                DrainRemoteFrees();
+            }
+            return m_arena.ArenaAllocator::Allocate(sizeBytes);
+        }
+        return m_arena.m_globalAllocator.GlobalAllocator::Allocate(sizeBytes);
+    }
+
+    void DeAllocate(void* ptr, size_t osize) override
+    {
+        if (IsOwnerThread())
+        {
+            m_arena.ArenaAllocator::DeAllocate(ptr, osize);
+        }
+        else if (m_arena.OwnsBlock(ptr, osize))
+        {
+            PushRemoteFree(ptr, osize);
+        }
+        else
+        {
+            m_arena.m_globalAllocator.GlobalAllocator::DeAllocate(ptr, osize);
+        }
+    }
+
+    void* ReAllocate(void* ptr, size_t osize, size_t nsize) override
+    {
+        if (IsOwnerThread())
+        {
+            return m_arena.ArenaAllocator::ReAllocate(ptr, osize, nsize);
+        }
+
+        // Not our arena to resize: copy into global memory, hand the old block back to the owner
+        size_t bytesToCopy = osize < nsize ? osize : nsize;
+        void* newPtr = m_arena.m_globalAllocator.GlobalAllocator::Allocate(nsize);
+        if (newPtr == nullptr)
+        {
+            return nsize <= osize ? ptr : nullptr;
+        }
+        memcpy(newPtr, ptr, bytesToCopy);
+        ThreadArena::DeAllocate(ptr, osize);
+        return newPtr;
+    }
+};
+
+/*
+ Hands every worker thread its own ThreadArena.
+ The mutex is only taken the first time a thread asks for its arena, after that the arena is cached in a thread_local.
+ When the thread exits, its arena goes back to the manager (a thread_local guard): remote frees are drained,
+ then the next new thread takes it over instead of a new arena being made. So there are never more arenas
+ than threads using the manager at once. States still pinned to a released arena keep working: until another
+ thread takes it, every thread is a remote thread to it.
+ */
+struct ThreadArenaManager
+{
+    // Shared with the thread guards, so a thread exiting after the manager is gone doesn't touch freed memory
+    struct Arenas
+    {
+        std::mutex m_mutex;
+        std::vector<std::unique_ptr<ThreadArena>> m_all;
+        std::vector<ThreadArena*> m_free;           // Released by threads that exited
+    };
+
+    // One per thread: the arenas it got from every manager, released when the thread exits
+    struct ThreadGuard
+    {
+        struct Entry
+        {
+            int m_managerId;
+            std::weak_ptr<Arenas> m_arenas;
+            ThreadArena* m_arena;
+        };
+        std::vector<Entry> m_entries;
+
+        ~ThreadGuard()
+        {
+            for (auto& entry : m_entries)
+            {
+                std::shared_ptr<Arenas> arenas = entry.m_arenas.lock();
+                if (arenas)
+                {
+                    Release(*arenas, *entry.m_arena);
+                }
+            }
+        }
+    };
+
+    size_t m_arenaSize;
+    int m_id;
+    std::shared_ptr<Arenas> m_arenas;
+
+    ThreadArenaManager(size_t arenaSizeBytes)
+    : m_arenaSize(arenaSizeBytes),
+    m_id(NextManagerId()),
+    m_arenas(std::make_shared<Arenas>())
+    { }
+
+    // Identifies the manager in the thread_local cache (a new manager may reuse the address of a destroyed one)
+    static int NextManagerId()
+    {
+        static std::atomic<int> s_nextId(1);
+        return s_nextId++;
+    }
+
+    static ThreadGuard& CurrentThreadGuard()
+    {
+        static thread_local ThreadGuard tl_guard;
+        return tl_guard;
+    }
+
+    // Owner thread only: hands the arena back for the next thread
+    static void Release(Arenas& arenas, ThreadArena& arena)
+    {
+        arena.DrainRemoteFrees();
+        arena.m_owner.store(std::thread::id(), std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(arenas.m_mutex);
+        arenas.m_free.push_back(&arena);
+    }
+
+    // A released arena if there is one, else a new one
+    ThreadArena* Acquire()
+    {
+        std::lock_guard<std::mutex> lock(m_arenas->m_mutex);
+        if (!m_arenas->m_free.empty())
+        {
+            ThreadArena* arena = m_arenas->m_free.back();
+            m_arenas->m_free.pop_back();
+            arena->m_owner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+            return arena;
+        }
+        m_arenas->m_all.emplace_back(new ThreadArena(m_arenaSize));
+        return m_arenas->m_all.back().get();
+    }
+
+    // Arena of the calling thread, taken the first time the thread asks
+    ThreadArena& ForCurrentThread()
+    {
+        static thread_local int tl_managerId = 0;
+        static thread_local ThreadArena* tl_arena = nullptr;
+
+        if (tl_managerId != m_id)
+        {
+            ThreadGuard& guard = CurrentThreadGuard();
+            tl_arena = nullptr;
+            for (auto& entry : guard.m_entries)
+            {
+                if (entry.m_managerId == m_id)
+                {
+                    tl_arena = entry.m_arena;
+                    break;
+                }
+            }
+            if (tl_arena == nullptr)
+            {
+                // Forget managers that are gone
+                for (size_t i = guard.m_entries.size(); i-- > 0;)
+                {
+                    if (guard.m_entries[i].m_arenas.expired())
+                    {
+                        guard.m_entries.erase(guard.m_entries.begin() + i);
+                    }
+                }
+                tl_arena = Acquire();
+                guard.m_entries.push_back({ m_id, m_arenas, tl_arena });
+            }
+            tl_managerId = m_id;
+        }
+        return *tl_arena;
+    }
+
+    size_t NumArenas() const
+    {
+        std::lock_guard<std::mutex> lock(m_arenas->m_mutex);
+        return m_arenas->m_all.size();
+    }
+
+    // New lua_State pinned to the calling thread's arena
+    lua_State* NewState()
+    {
+        return lua_newstate(StaticAllocator<ThreadArena>::l_alloc, &ForCurrentThread());
+    }
+};
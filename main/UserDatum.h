@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <rttr/registration>
+
+/*
+ How a bound class is stored inside a lua user datum.
+
+ The object lives in the user datum itself, right after a small header, constructed in place:
+ one allocation per object and no pointer chase to reach it.
+
+ [ UserDatumHeader | padding to the class alignment | object ]
+
+ Classes opt in by registering their layout as RTTR metadata:
+
+ rttr::registration::class_<Sprite>("Sprite")
+     (rttr::metadata(BindingMetadata::InlineLayout, InlineLayout::Of<Sprite>()))
+     .constructor()...
+
+ Classes without it get VariantLayout(): the user datum holds the rttr::variant made by rttr::type::create().
+ */
+enum class BindingMetadata
+{
+    InlineLayout
+};
+
+struct InlineLayout
+{
+    size_t m_size;
+    size_t m_alignment;
+    void (*m_construct)(void* memory, const rttr::type& type);
+    void (*m_destroy)(void* object);
+    rttr::instance (*m_instance)(void* object);             // What RTTR invokes methods and properties on
+
+    template <typename T>
+    static InlineLayout Of()
+    {
+        InlineLayout layout;
+        layout.m_size = sizeof(T);
+        layout.m_alignment = alignof(T);
+        layout.m_construct = [](void* memory, const rttr::type& /*type*/) { new (memory) T(); };
+        layout.m_destroy = [](void* object) { static_cast<T*>(object)->~T(); };
+        layout.m_instance = [](void* object) { return rttr::instance(*static_cast<T*>(object)); };
+        return layout;
+    }
+};
+
+// Fallback for classes registered without an InlineLayout
+inline InlineLayout VariantLayout()
+{
+    InlineLayout layout;
+    layout.m_size = sizeof(rttr::variant);
+    layout.m_alignment = alignof(rttr::variant);
+    layout.m_construct = [](void* memory, const rttr::type& type) { new (memory) rttr::variant(type.create()); };
+    layout.m_destroy = [](void* object) { static_cast<rttr::variant*>(object)->~variant(); };
+    layout.m_instance = [](void* object) { return rttr::instance(*static_cast<rttr::variant*>(object)); };
+    return layout;
+}
+
+// Type tag at the start of every user datum of a bound class
+struct UserDatumHeader
+{
+    const InlineLayout* m_layout;
+};
+
+// Lua aligns user datum memory for its largest basic type (LUAI_USER_ALIGNMENT_T), at least a double
+constexpr size_t USER_DATUM_ALIGNMENT = alignof(double);
+
+// Size to ask lua for, with room to align objects that need more than lua gives
+inline size_t UserDatumSize(const InlineLayout& layout)
+{
+    size_t padding = layout.m_alignment > USER_DATUM_ALIGNMENT ? layout.m_alignment - USER_DATUM_ALIGNMENT : 0;
+    return sizeof(UserDatumHeader) + padding + layout.m_size;
+}
+
+inline void* ObjectOf(UserDatumHeader* header)
+{
+    uintptr_t object = reinterpret_cast<uintptr_t>(header + 1);
+    uintptr_t alignment = header->m_layout->m_alignment;
+    return reinterpret_cast<void*>((object + alignment - 1) & ~(alignment - 1));
+}
+
+inline rttr::instance InstanceOf(UserDatumHeader* header)
+{
+    return header->m_layout->m_instance(ObjectOf(header));
+}
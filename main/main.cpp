@@ -1,11 +1,28 @@
+#include "AllocatorStats.h"
 #include "ArenaAllocator.h"
+#include "AsyncScheduler.h"
 #include "AutomatedBinding.h"
+#include "GcScheduler.h"
+#include "LuaString.h"
+#include "PropertyDispatch.h"
+#include "ScriptBundle.h"
+#include "ScriptCache.h"
+#include "ScriptExecutor.h"
+#include "SlotMap.h"
+#include "SpriteSystem.h"
+#include "StatePool.h"
+#include "ThreadArenaAllocator.h"
 #include "lua.hpp"
+#include <atomic>
 #include <iostream>
 #include <assert.h>
 #include <string.h>
 #include <cstdio>
+#include <cstdlib>
+#include <chrono>
 #include <new>
+#include <string>
+#include <thread>
 #include <vector>
 
 // Lua types:
@@ -26,6 +43,17 @@
 // call lua functions from c
 // bind and call c functions from lua
 
+// Files the tutorial writes go to the temp directory, not wherever the program was started from
+static std::string TempFilePath(const char* fileName)
+{
+    const char* tempDirectory = getenv("TMPDIR");
+    if (tempDirectory == nullptr)
+    {
+        tempDirectory = getenv("TEMP");     // Windows
+    }
+    return std::string(tempDirectory ? tempDirectory : "/tmp") + "/" + fileName;
+}
+
 int main()
 {
 	// Intro
@@ -236,15 +264,15 @@ int main()
 		// Get value from table
 		lua_gettable(L, -2);
 
-		// Note: Pointer to a string. Lua will garbage collectl
-		const char* dave = lua_tostring(L, -1);
-		printf("Dave is: %s\n", dave);
+		// Note: View of lua's own string (no copy, length included). Valid while the value is on the stack
+		StringView dave = ToStringView(L, -1);
+		printf("Dave is: %.*s\n", (int) dave.size(), dave.data());
 
 		// Simpler way of grabbing variable from table
 		lua_getglobal(L, "x");
 		lua_getfield(L, -1, "ian");
-		const char* ian = lua_tostring(L, -1);
-		printf("Ian is: %s\n", ian);
+		StringView ian = ToStringView(L, -1);
+		printf("Ian is: %.*s\n", (int) ian.size(), ian.data());
 
 		// Push value into table
 		lua_getglobal(L, "x");
@@ -255,8 +283,8 @@ int main()
 		// Simpler way of grabbing variable from table
 		lua_getglobal(L, "x");
 		lua_getfield(L, -1, "john");
-		const char* john = lua_tostring(L, -1);
-		printf("John is: %s\n", john);
+		StringView john = ToStringView(L, -1);
+		printf("John is: %.*s\n", (int) john.size(), john.data());
 
 
 		lua_close(L);
@@ -677,7 +705,7 @@ int main()
 			assert(lua_isstring(L, -1));		// Index we are accessing "x"
 
 			Sprite* sprite = (Sprite*)lua_touserdata(L, -2);
-			const char* index = lua_tostring(L, -1);
+			const char* index = lua_tostring(L, -1);	// Lua's own NUL terminated string, no copy (strcmp needs no length)
 			
 			// Properties
 			if (strcmp(index, "x") == 0)
@@ -805,9 +833,8 @@ int main()
 			lua_setmetatable(L, -2);		// Set metatable to user datum Sprite. This command pops metatable off stack
 
 			// USER TABLE:
-			// Stores any additional value to the native object that we didn't have at compile time
-			lua_newtable(L);
-			lua_setuservalue(L, 1);		// Associate this userdatum with the non-native table
+			// Stores any additional value to the native object that we didn't have at compile time.
+			// Created by __newindex the first time one is set: most sprites never need one
 
 			return 1;
 		};
@@ -842,7 +869,7 @@ int main()
 			assert(lua_isstring(L, -1));	//2
 
 			Sprite* sprite = (Sprite*)lua_touserdata(L, -2);
-			const char* index = lua_tostring(L, -1);
+			const char* index = lua_tostring(L, -1);	// Lua's own NUL terminated string, no copy (strcmp needs no length)
 			if (strcmp(index, "x") == 0)
 			{
 				lua_pushnumber(L, sprite->x);
@@ -855,9 +882,12 @@ int main()
 			}
 			else
 			{
-				lua_getuservalue(L, 1);
-				lua_pushvalue(L, 2);
-				lua_gettable(L, -2);
+				// No user value table yet: nothing was stored, go straight to the methods
+				if (lua_getuservalue(L, 1) == LUA_TTABLE)
+				{
+					lua_pushvalue(L, 2);
+					lua_gettable(L, -2);
+				}
 				if (lua_isnil(L, -1))
 				{
 					lua_getglobal(L, "Sprite");
@@ -874,7 +904,7 @@ int main()
 										   // 3 - Value we want to set
 
 			Sprite* sprite = (Sprite*)lua_touserdata(L, -3);
-			const char* index = lua_tostring(L, -2);
+			const char* index = lua_tostring(L, -2);	// Lua's own NUL terminated string, no copy (strcmp needs no length)
 
 			// Properties
 			if (strcmp(index, "x") == 0)
@@ -887,8 +917,14 @@ int main()
 			}
 			else
 			{
-				// Get user value table associated with this user datum
-				lua_getuservalue(L, 1);	// 1 - table
+				// Get user value table associated with this user datum, created on the first dynamic field
+				if (lua_getuservalue(L, 1) != LUA_TTABLE)	// 1 - table
+				{
+					lua_pop(L, 1);
+					lua_newtable(L);
+					lua_pushvalue(L, -1);
+					lua_setuservalue(L, 1);
+				}
 				lua_pushvalue(L, 2);	// 2 - index
 				lua_pushvalue(L, 3);	// 3 - value
 				lua_settable(L, -3);
@@ -915,6 +951,9 @@ int main()
         
         ArenaAllocator pool(memory, &memory[POOL_SIZE - 1]);
         
+        // Same script in every state: parse it once, load bytecode afterwards
+        ScriptCache scriptCache;
+        
         for (int i = 0; i < 10; i++)
         {
             pool.Reset();
@@ -958,7 +997,7 @@ int main()
             lua_pushcfunction(L, SpriteNewIndex);
             lua_settable(L, -3);
 
-            int err = luaL_dostring(L, LUA_FILE);
+            int err = scriptCache.DoString(L, LUA_FILE, "=sprites");
             if (err == LUA_OK)
             {
                 //printf("Ok.\n");
@@ -970,6 +1009,9 @@ int main()
 
             lua_close(L);
         }
+        
+        printf("Script cache: %d hits, %d misses, %.3fms of parsing saved\n",
+               (int) scriptCache.m_hits, (int) scriptCache.m_misses, scriptCache.m_parseMsSaved);
 
 		assert(numberOfSpritesExisting == 0);
 
@@ -989,9 +1031,16 @@ int main()
         // *ud: called for every allocation (good for debug allocation tracking ect.)
         lua_State* L = lua_newstate(ArenaAllocator::l_alloc, &pool);
         
+        // Growing a table makes lua reallocate its array part over and over
+        luaL_dostring(L, "local t = {} for i = 1, 200 do t[i] = i end");
         
         lua_close(L);
         
+        printf("Reallocations in place: %d, copied: %d (%d bytes)\n",
+               (int) pool.m_reallocCounters.m_inPlace,
+               (int) pool.m_reallocCounters.m_copied,
+               (int) pool.m_reallocCounters.m_bytesCopied);
+        
     }
     
     printf("---- Lua aligned memory allocator ----\n");
@@ -1021,6 +1070,851 @@ int main()
         
     }
     
+    printf("---- Growable arena ----\n");
+    {
+        // Starts with a 64KB chunk mapped from the OS, chains bigger chunks as lua needs them.
+        // Never maps more than 1MB: past that lua gets a memory error instead of a heap allocation
+        ArenaAllocator pool(1024 * 64, 1024 * 1024);
+        
+        lua_State* L = lua_newstate(ArenaAllocator::l_alloc, &pool);
+        
+        int err = luaL_dostring(L, "local t = {} for i = 1, 1000000 do t[i] = 'item' .. i end");
+        if (err == LUA_ERRMEM)
+        {
+            printf("Hit the hard cap: %s (%d bytes mapped)\n", lua_tostring(L, -1), (int) pool.m_mappedBytes);
+        }
+        
+        lua_close(L);
+    }
+    
+    printf("---- Allocation telemetry ----\n");
+    {
+        constexpr int POOL_SIZE = 1024 * 64;
+        std::vector<char> memory(POOL_SIZE);
+        ArenaAllocator pool(memory.data(), memory.data() + POOL_SIZE);
+        
+        // Wraps the arena, one StatsAllocator per lua_State
+        StatsAllocator<ArenaAllocator> stats(pool);
+        lua_State* L = lua_newstate(StaticAllocator<StatsAllocator<ArenaAllocator>>::l_alloc, &stats);
+        
+        // Lua can query its own stats too
+        stats.RegisterLuaFunction(L);
+        
+        const char* LUA_FILE = R"(
+        local t = {}
+        for i = 1, 2000 do t[i] = { i } end
+        t = nil
+        peak = AllocatorStats().peakBytes
+        )";
+        
+        int err = luaL_dostring(L, LUA_FILE);
+        if (err != LUA_OK)
+        {
+            printf("Error: %s\n", lua_tostring(L, -1));
+        }
+        
+        lua_getglobal(L, "peak");
+        printf("Peak bytes seen from lua: %d\n", (int) lua_tointeger(L, -1));
+        
+        AllocatorStats current = StatsAllocator<ArenaAllocator>::FromState(L)->GetStats();
+        printf("Live: %d bytes, peak: %d bytes, free list hit rate: %.2f, fallbacks: %d, realloc bytes copied: %d\n",
+               (int) current.m_liveBytes,
+               (int) current.m_peakBytes,
+               current.FreeListHitRate(),
+               (int) current.m_fallbacks,
+               (int) current.m_reallocBytesCopied);
+        
+        for (int i = 0; i < AllocatorStats::NUM_HISTOGRAM_BUCKETS; i++)
+        {
+            if (current.m_sizeHistogram[i])
+            {
+                printf("  <= %d bytes: %d\n", (int) AllocatorStats::HistogramBucketLimit(i), (int) current.m_sizeHistogram[i]);
+            }
+        }
+        
+        lua_close(L);
+    }
+    
+    printf("---- GC scheduler ----\n");
+    {
+        // Frames that make garbage, with a live set lua has to keep marking
+        const char* LUA_FILE = R"(
+        live = {}
+        for i = 1, 20000 do live[i] = { i } end
+        function Frame(frame)
+            for i = 1, 2000 do
+                local garbage = { frame, i }
+            end
+            live[frame % 20000 + 1] = { frame }
+        end
+        )";
+        constexpr int NUM_FRAMES = 300;
+        
+        GlobalAllocator global;
+        StatsAllocator<GlobalAllocator> stats(global);
+        
+        // Run with lua's automatic collector, then with the scheduler doing the collecting between frames
+        for (int scheduled = 0; scheduled < 2; scheduled++)
+        {
+            lua_State* L = lua_newstate(StaticAllocator<StatsAllocator<GlobalAllocator>>::l_alloc, &stats);
+            luaL_dostring(L, LUA_FILE);
+            
+            GcScheduler* scheduler = nullptr;
+            if (scheduled)
+            {
+                scheduler = new GcScheduler(L, &stats.m_stats, 500.0);     // 0.5ms per frame
+                scheduler->SetPause(150);
+                scheduler->m_emergencyKb = 64 * 1024;
+            }
+            
+            double worstFrameUs = 0.0;
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int frame = 0; frame < NUM_FRAMES; frame++)
+            {
+                auto frameStart = std::chrono::high_resolution_clock::now();
+                lua_getglobal(L, "Frame");
+                lua_pushinteger(L, frame);
+                if (lua_pcall(L, 1, 0, 0) != LUA_OK)
+                {
+                    printf("Error: %s\n", lua_tostring(L, -1));
+                    lua_pop(L, 1);
+                }
+                double frameUs = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - frameStart).count();
+                worstFrameUs = frameUs > worstFrameUs ? frameUs : worstFrameUs;
+                
+                if (scheduler)
+                {
+                    scheduler->Tick();
+                }
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            
+            printf("%s: %d frames %.2fms, worst script frame %.1fus, heap %dKB\n",
+                   scheduled ? "Scheduled" : "Automatic", NUM_FRAMES,
+                   std::chrono::duration<double, std::milli>(end - start).count(), worstFrameUs, lua_gc(L, LUA_GCCOUNT, 0));
+            if (scheduler)
+            {
+                scheduler->PrintStats(stdout);
+                delete scheduler;
+            }
+            lua_close(L);
+        }
+    }
+    
+    printf("---- Devirtualized allocator policy ----\n");
+    {
+        // IAllocator<T>::l_alloc calls the virtual Allocate/DeAllocate/ReAllocate,
+        // StaticAllocator<T>::l_alloc calls them directly so they can be inlined
+        const char* LUA_FILE = R"(
+        for i = 1, 20000 do
+            local t = { i, i + 1, i + 2, name = "item" .. i }
+            t.next = { t }
+        end
+        )";
+        
+        constexpr int NUM_RUNS = 20;
+        
+        // 4MB of heap memory, most of the garbage gets recycled through the free lists
+        constexpr int POOL_SIZE = 1024 * 1024 * 4;
+        std::vector<char> memory(POOL_SIZE);
+        ArenaAllocator pool(memory.data(), memory.data() + POOL_SIZE);
+        GlobalAllocator global;
+        
+        // Runs the GC heavy script in a fresh state, returns milliseconds taken
+        auto TimeScript = [&](lua_Alloc allocFunction, void* ud) -> double
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < NUM_RUNS; i++)
+            {
+                pool.Reset();
+                lua_State* L = lua_newstate(allocFunction, ud);
+                int err = luaL_dostring(L, LUA_FILE);
+                if (err != LUA_OK)
+                {
+                    printf("Error: %s\n", lua_tostring(L, -1));
+                }
+                lua_close(L);
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            return std::chrono::duration<double, std::milli>(end - start).count();
+        };
+        
+        // Timed one after the other (the order of printf's arguments is unspecified)
+        double arenaVirtualMs = TimeScript(IAllocator<ArenaAllocator>::l_alloc, &pool);
+        double arenaStaticMs = TimeScript(StaticAllocator<ArenaAllocator>::l_alloc, &pool);
+        double globalVirtualMs = TimeScript(IAllocator<GlobalAllocator>::l_alloc, &global);
+        double globalStaticMs = TimeScript(StaticAllocator<GlobalAllocator>::l_alloc, &global);
+        printf("ArenaAllocator  virtual: %.2fms, static: %.2fms\n", arenaVirtualMs, arenaStaticMs);
+        printf("GlobalAllocator virtual: %.2fms, static: %.2fms\n", globalVirtualMs, globalStaticMs);
+    }
+    
+    printf("---- Per-thread arenas ----\n");
+    {
+        // One lua_State per worker thread, each worker allocates from its own arena (no locks, no shared heap)
+        static std::atomic<int> numberOfSpritesExisting(0);
+        
+        // Our own type
+        struct Sprite
+        {
+            int x;
+            int y;
+            
+            Sprite() : x(0), y(0)
+            {
+                numberOfSpritesExisting++;
+            }
+            
+            ~Sprite()
+            {
+                numberOfSpritesExisting--;
+            }
+            
+            void Move(int velX, int velY)
+            {
+                x += velX;
+                y += velY;
+            }
+        };
+        
+        auto CreateSprite = [](lua_State* L) -> int
+        {
+            void* pointerToSprite = lua_newuserdata(L, sizeof(Sprite));
+            new (pointerToSprite) Sprite();
+            luaL_getmetatable(L, "SpriteMetaTable");
+            lua_setmetatable(L, -2);
+            return 1;
+        };
+        
+        auto DestroySprite = [](lua_State* L) -> int
+        {
+            Sprite* sprite = (Sprite*)lua_touserdata(L, -1);
+            sprite->~Sprite();
+            return 0;
+        };
+        
+        auto MoveSprite = [](lua_State* L) -> int
+        {
+            Sprite* sprite = (Sprite*)lua_touserdata(L, -3);
+            lua_Number velX = lua_tonumber(L, -2);
+            lua_Number velY = lua_tonumber(L, -1);
+            sprite->Move((int)velX, (int)velY);
+            return 0;
+        };
+        
+        const char* LUA_FILE = R"(
+        for i = 1, 1000 do
+            local sprite = Sprite.new()
+            sprite:Move(5, 7)
+            sprite:Move(1, 2)
+        end
+        )";
+        
+        constexpr int STATES_PER_THREAD = 50;
+        
+        // 1MB arena per worker thread
+        ThreadArenaManager arenas(1024 * 1024);
+        
+        // Every worker creates, binds, runs and closes its own states
+        auto Worker = [&]()
+        {
+            for (int i = 0; i < STATES_PER_THREAD; i++)
+            {
+                lua_State* L = arenas.NewState();
+                
+                lua_newtable(L);
+                lua_pushvalue(L, -1);
+                lua_setglobal(L, "Sprite");
+                lua_pushcfunction(L, CreateSprite);
+                lua_setfield(L, -2, "new");
+                lua_pushcfunction(L, MoveSprite);
+                lua_setfield(L, -2, "Move");
+                
+                luaL_newmetatable(L, "SpriteMetaTable");
+                lua_pushcfunction(L, DestroySprite);
+                lua_setfield(L, -2, "__gc");
+                lua_pushvalue(L, -2);
+                lua_setfield(L, -2, "__index");
+                
+                int err = luaL_dostring(L, LUA_FILE);
+                if (err != LUA_OK)
+                {
+                    printf("Error: %s\n", lua_tostring(L, -1));
+                }
+                lua_close(L);
+            }
+        };
+        
+        int maxThreads = (int) std::thread::hardware_concurrency();
+        if (maxThreads < 1)
+        {
+            maxThreads = 1;
+        }
+        
+        for (int numThreads = 1; numThreads <= maxThreads; numThreads *= 2)
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            
+            std::vector<std::thread> threads;
+            for (int t = 0; t < numThreads; t++)
+            {
+                threads.emplace_back(Worker);
+            }
+            for (auto& thread : threads)
+            {
+                thread.join();
+            }
+            
+            auto end = std::chrono::high_resolution_clock::now();
+            double seconds = std::chrono::duration<double>(end - start).count();
+            printf("%d thread(s): %.0f states/s\n", numThreads, (numThreads * STATES_PER_THREAD) / seconds);
+        }
+        
+        printf("%d arenas for up to %d threads at once\n", (int) arenas.NumArenas(), maxThreads);
+        assert(numberOfSpritesExisting == 0);
+    }
+    
+    printf("---- Pooled lua_States ----\n");
+    {
+        // Per request: a fully bound state (Sprite table, metatable, script parsed)
+        
+        // Our own type
+        struct Sprite
+        {
+            int x;
+            int y;
+            
+            void Move(int velX, int velY)
+            {
+                x += velX;
+                y += velY;
+            }
+        };
+        
+        auto CreateSprite = [](lua_State* L) -> int
+        {
+            Sprite* sprite = (Sprite*) lua_newuserdata(L, sizeof(Sprite));
+            sprite->x = 0;
+            sprite->y = 0;
+            luaL_getmetatable(L, "SpriteMetaTable");
+            lua_setmetatable(L, -2);
+            return 1;
+        };
+        
+        auto MoveSprite = [](lua_State* L) -> int
+        {
+            Sprite* sprite = (Sprite*)lua_touserdata(L, -3);
+            lua_Number velX = lua_tonumber(L, -2);
+            lua_Number velY = lua_tonumber(L, -1);
+            sprite->Move((int)velX, (int)velY);
+            return 0;
+        };
+        
+        const char* LUA_FILE = R"(
+        function HandleRequest(velX, velY)
+            local sprite = Sprite.new()
+            sprite:Move(velX, velY)
+            sprite:Move(1, 2)
+            return sprite
+        end
+        )";
+        
+        // Everything done to a fresh state before it can serve a request
+        auto SetupState = [&](lua_State* L)
+        {
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_setglobal(L, "Sprite");
+            lua_pushcfunction(L, CreateSprite);
+            lua_setfield(L, -2, "new");
+            lua_pushcfunction(L, MoveSprite);
+            lua_setfield(L, -2, "Move");
+            
+            luaL_newmetatable(L, "SpriteMetaTable");
+            lua_pushvalue(L, -2);
+            lua_setfield(L, -2, "__index");
+            
+            int err = luaL_dostring(L, LUA_FILE);
+            if (err != LUA_OK)
+            {
+                printf("Error: %s\n", lua_tostring(L, -1));
+            }
+        };
+        
+        auto HandleRequest = [](lua_State* L)
+        {
+            lua_getglobal(L, "HandleRequest");
+            lua_pushnumber(L, 5);
+            lua_pushnumber(L, 7);
+            lua_pcall(L, 2, 1, 0);
+            Sprite* sprite = (Sprite*) lua_touserdata(L, -1);
+            assert(sprite && sprite->x == 6 && sprite->y == 9);
+            (void) sprite;
+        };
+        
+        constexpr int NUM_REQUESTS = 1000;
+        constexpr int ARENA_SIZE = 1024 * 64;
+        
+        // Cold: build a state for every request
+        std::vector<char> memory(ARENA_SIZE);
+        ArenaAllocator pool(memory.data(), memory.data() + ARENA_SIZE);
+        
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < NUM_REQUESTS; i++)
+        {
+            pool.Reset();
+            lua_State* L = lua_newstate(StaticAllocator<ArenaAllocator>::l_alloc, &pool);
+            SetupState(L);
+            HandleRequest(L);
+            lua_close(L);
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        double coldMs = std::chrono::duration<double, std::milli>(end - start).count();
+        
+        // Pooled: golden states are built once, restored from their arena image after each request
+        StatePool statePool(4, ARENA_SIZE, SetupState);
+        
+        start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < NUM_REQUESTS; i++)
+        {
+            lua_State* L = statePool.Acquire();
+            HandleRequest(L);
+            statePool.Release(L);
+        }
+        end = std::chrono::high_resolution_clock::now();
+        double pooledMs = std::chrono::duration<double, std::milli>(end - start).count();
+        
+        printf("%d requests, cold setup: %.2fms, pooled: %.2fms (%d restores, %d cold builds)\n",
+               NUM_REQUESTS, coldMs, pooledMs, (int) statePool.m_restores, (int) statePool.m_coldBuilds);
+    }
+    
+    printf("---- Work-stealing script executor ----\n");
+    {
+        // Our own type
+        struct Sprite
+        {
+            int x;
+            int y;
+        };
+        
+        auto CreateSprite = [](lua_State* L) -> int
+        {
+            Sprite* sprite = (Sprite*) lua_newuserdata(L, sizeof(Sprite));
+            sprite->x = (int) luaL_optinteger(L, 1, 0);
+            sprite->y = (int) luaL_optinteger(L, 2, 0);
+            luaL_getmetatable(L, "SpriteMetaTable");
+            lua_setmetatable(L, -2);
+            return 1;
+        };
+        
+        auto MoveSprite = [](lua_State* L) -> int
+        {
+            Sprite* sprite = (Sprite*) luaL_checkudata(L, 1, "SpriteMetaTable");
+            sprite->x += (int) lua_tointeger(L, 2);
+            sprite->y += (int) lua_tointeger(L, 3);
+            lua_pushinteger(L, sprite->x);
+            lua_pushinteger(L, sprite->y);
+            return 2;
+        };
+        
+        // Every state of every worker is built with the Sprite and Global bindings
+        auto SetupState = [=](lua_State* L)
+        {
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_setglobal(L, "Sprite");
+            lua_pushcfunction(L, CreateSprite);
+            lua_setfield(L, -2, "new");
+            lua_pushcfunction(L, MoveSprite);
+            lua_setfield(L, -2, "Move");
+            
+            luaL_newmetatable(L, "SpriteMetaTable");
+            lua_pushvalue(L, -2);
+            lua_setfield(L, -2, "__index");
+            
+            BindGlobalMethods(L, "Global");
+        };
+        
+        const char* JOB = R"(
+        local velX, velY = ...
+        local sprite = Sprite.new(1, 2)
+        local x, y
+        for i = 1, 100 do x, y = sprite:Move(velX, velY) end
+        return Global.Mul(x, y), "done"
+        )";
+        
+        constexpr int NUM_JOBS = 20000;
+        
+        int maxThreads = (int) std::thread::hardware_concurrency();
+        if (maxThreads < 1)
+        {
+            maxThreads = 1;
+        }
+        
+        for (int numThreads = 1; numThreads <= maxThreads; numThreads *= 2)
+        {
+            ScriptExecutor executor(numThreads, 1024 * 64, SetupState);
+            
+            auto start = std::chrono::high_resolution_clock::now();
+            std::vector<std::future<ScriptResult>> results;
+            results.reserve(NUM_JOBS);
+            for (int i = 0; i < NUM_JOBS; i++)
+            {
+                results.push_back(executor.Submit(JOB, { i % 7, 1 }));
+            }
+            
+            int failed = 0;
+            for (int i = 0; i < NUM_JOBS; i++)
+            {
+                ScriptResult result = results[i].get();
+                lua_Number expected = (1 + 100 * (i % 7)) * (2 + 100);
+                if (result.m_status != LUA_OK || result.m_values.size() != 2 || result.m_values[0].m_number != expected)
+                {
+                    if (failed++ == 0)
+                    {
+                        printf("Job %d failed: %s\n", i, result.m_error.c_str());
+                    }
+                }
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            double seconds = std::chrono::duration<double>(end - start).count();
+            
+            printf("%d worker(s): %.0f jobs/s, %d stolen, %d failed\n",
+                   numThreads, NUM_JOBS / seconds, (int) executor.JobsStolen(), failed);
+        }
+    }
+    
+    printf("---- Async natives on coroutines ----\n");
+    {
+        lua_State* L = luaL_newstate();
+        luaL_requiref(L, "_G", luaopen_base, 1);       // pcall
+        lua_pop(L, 1);
+        
+        AsyncScheduler scheduler(L);
+        scheduler.BindStandIns(L);
+        
+        std::string filePath = TempFilePath("async_stand_in.txt");
+        const char* FILE_PATH = filePath.c_str();
+        FILE* file = fopen(FILE_PATH, "wb");
+        bool haveFile = file != nullptr;
+        if (haveFile)
+        {
+            fputs("Hello from the event loop", file);
+            fclose(file);
+        }
+        else
+        {
+            printf("Can't write '%s', skipping the ReadFile task\n", FILE_PATH);
+        }
+        
+        // Reads like blocking code, every Async call yields the task back to the loop
+        const char* LUA_FILE = R"(
+        completed = 0
+        function Worker(id)
+            Async.Sleep(id % 10)
+            Async.Sleep(5)
+            completed = completed + 1
+        end
+        function Reader(path)
+            contents = Async.ReadFile(path)
+            local ok, err = pcall(Async.ReadFile, "does/not/exist.txt")
+            readError = err
+            Async.Spawn(function() Async.Sleep(1) spawnedFromLua = true end)
+        end
+        )";
+        
+        int err = luaL_dostring(L, LUA_FILE);
+        if (err != LUA_OK)
+        {
+            printf("Error: %s\n", lua_tostring(L, -1));
+        }
+        
+        constexpr int NUM_TASKS = 5000;
+        for (int i = 0; i < NUM_TASKS; i++)
+        {
+            lua_getglobal(L, "Worker");
+            lua_pushinteger(L, i);
+            scheduler.Spawn(L, 1);
+        }
+        if (haveFile)
+        {
+            lua_getglobal(L, "Reader");
+            lua_pushstring(L, FILE_PATH);
+            scheduler.Spawn(L, 1);
+        }
+        
+        // Calling an async native outside a task is an error, not a hang
+        err = luaL_dostring(L, "Async.Sleep(1)");
+        printf("Outside a task: %s\n", err != LUA_OK ? lua_tostring(L, -1) : "no error");
+        lua_settop(L, 0);
+        
+        auto start = std::chrono::high_resolution_clock::now();
+        scheduler.Run();
+        auto end = std::chrono::high_resolution_clock::now();
+        
+        lua_getglobal(L, "completed");
+        lua_getglobal(L, "contents");
+        lua_getglobal(L, "readError");
+        lua_getglobal(L, "spawnedFromLua");
+        printf("%d tasks sleeping 5-14ms each took %.2fms on one thread (%d resumes, %d failed)\n",
+               (int) lua_tointeger(L, 1), std::chrono::duration<double, std::milli>(end - start).count(),
+               (int) scheduler.m_resumes, (int) scheduler.m_tasksFailed);
+        if (haveFile)
+        {
+            printf("Read '%s', missing file: %s, spawned from lua: %s\n",
+                   lua_tostring(L, 2), lua_tostring(L, 3), lua_toboolean(L, 4) ? "yes" : "no");
+            remove(FILE_PATH);
+        }
+        assert(lua_tointeger(L, 1) == NUM_TASKS && scheduler.m_tasks.empty());
+        
+        scheduler.Shutdown();           // Releases whatever tasks are left while the state is still open
+        lua_close(L);
+    }
+    
+    printf("---- Zero-copy strings ----\n");
+    {
+        // A large immutable native blob, the script only looks for a few things in it
+        std::string config;
+        for (int i = 0; i < 100000; i++)
+        {
+            config += "setting" + std::to_string(i) + " = " + std::to_string(i * 7) + "\n";
+        }
+        config += "needle = 42\n";
+        
+        GlobalAllocator global;
+        StatsAllocator<GlobalAllocator> stats(global);
+        lua_State* L = lua_newstate(StaticAllocator<StatsAllocator<GlobalAllocator>>::l_alloc, &stats);
+        luaL_requiref(L, "string", luaopen_string, 1);
+        lua_pop(L, 1);
+        
+        // Same script for a lua string (string.find) and an ExternalBuffer (buffer:find)
+        const char* LUA_FILE = R"(
+        function Lookup(config)
+            local first, last = config:find("needle = ", 1, true)
+            return tonumber(config:sub(last + 1, last + 2))
+        end
+        )";
+        luaL_requiref(L, "_G", luaopen_base, 1);       // tonumber
+        lua_pop(L, 1);
+        int err = luaL_dostring(L, LUA_FILE);
+        if (err != LUA_OK)
+        {
+            printf("Error: %s\n", lua_tostring(L, -1));
+        }
+        
+        constexpr int NUM_REQUESTS = 100;
+        
+        // Every request hands the config to the script, either copied into a lua string or as a buffer
+        auto TimeRequests = [&](bool external, int& result) -> double
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < NUM_REQUESTS; i++)
+            {
+                lua_getglobal(L, "Lookup");
+                if (external)
+                {
+                    PushExternalBuffer(L, config.data(), config.size());
+                }
+                else
+                {
+                    PushString(L, config);
+                }
+                if (lua_pcall(L, 1, 1, 0) != LUA_OK)
+                {
+                    printf("Error: %s\n", lua_tostring(L, -1));
+                }
+                result = (int) lua_tointeger(L, -1);
+                lua_pop(L, 1);
+            }
+            lua_gc(L, LUA_GCCOLLECT, 0);
+            auto end = std::chrono::high_resolution_clock::now();
+            return std::chrono::duration<double, std::milli>(end - start).count();
+        };
+        
+        int copiedResult = 0;
+        int externalResult = 0;
+        size_t bytesBefore = stats.m_stats.m_bytesAllocated;
+        double copiedMs = TimeRequests(false, copiedResult);
+        size_t copiedBytes = stats.m_stats.m_bytesAllocated - bytesBefore;
+        bytesBefore = stats.m_stats.m_bytesAllocated;
+        double externalMs = TimeRequests(true, externalResult);
+        size_t externalBytes = stats.m_stats.m_bytesAllocated - bytesBefore;
+        
+        printf("%d lookups in a %dKB config, lua string: %.2fms (%dKB allocated), external buffer: %.2fms (%dKB allocated), found %d / %d\n",
+               NUM_REQUESTS, (int) (config.size() / 1024), copiedMs, (int) (copiedBytes / 1024),
+               externalMs, (int) (externalBytes / 1024), copiedResult, externalResult);
+        
+        // String-like methods, same index rules as lua strings
+        PushExternalBuffer(L, config.data(), config.size());
+        lua_setglobal(L, "config");
+        err = luaL_dostring(L, R"(
+        local head = config:view(1, 16)
+        return #config, head:tostring(), config:sub(-12, -2), config:byte(1), head:find("= "), config:find("missing")
+        )");
+        if (err != LUA_OK)
+        {
+            printf("Error: %s\n", lua_tostring(L, -1));
+        }
+        else
+        {
+            StringView head = ToStringView(L, 2);
+            printf("length %d, view '%.*s', tail '%s', first byte %d, find %d, missing %s\n",
+                   (int) lua_tointeger(L, 1), (int) head.size(), head.data(), lua_tostring(L, 3),
+                   (int) lua_tointeger(L, 4), (int) lua_tointeger(L, 5), lua_isnil(L, 7) ? "nil" : "found");
+        }
+        
+        lua_close(L);
+    }
+    
+    printf("---- Script bundle ----\n");
+    {
+        std::string bundlePath = TempFilePath("LuaTutorialScripts.bundle");
+        const char* BUNDLE_PATH = bundlePath.c_str();
+        constexpr int NUM_SCRIPTS = 300;
+        
+        std::vector<std::string> names;
+        std::vector<std::string> sources;
+        for (int i = 0; i < NUM_SCRIPTS; i++)
+        {
+            char text[256];
+            snprintf(text, sizeof(text), "script_%03d", i);
+            names.push_back(text);
+            snprintf(text, sizeof(text), "function Script%d(a, b) local sum = 0 for i = a, b do sum = sum + i * %d end return sum end", i, i);
+            sources.push_back(text);
+        }
+        
+        // Offline step: compile everything into one bundle
+        bool written = false;
+        {
+            lua_State* L = luaL_newstate();
+            ScriptBundleWriter writer;
+            for (int i = 0; i < NUM_SCRIPTS; i++)
+            {
+                writer.Add(L, names[i].c_str(), sources[i].c_str());
+            }
+            written = writer.Write(BUNDLE_PATH);
+            lua_close(L);
+        }
+        
+        // Without a bundle the comparison would time an empty load
+        if (!written)
+        {
+            printf("Can't write the bundle '%s', skipping the comparison\n", BUNDLE_PATH);
+        }
+        else
+        {
+            // Startup: load every script from source... (both timings leave out lua_close)
+            auto start = std::chrono::high_resolution_clock::now();
+            lua_State* L = luaL_newstate();
+            for (int i = 0; i < NUM_SCRIPTS; i++)
+            {
+                if (luaL_loadbuffer(L, sources[i].c_str(), sources[i].size(), names[i].c_str()) != LUA_OK || lua_pcall(L, 0, 0, 0) != LUA_OK)
+                {
+                    printf("Error: %s\n", lua_tostring(L, -1));
+                }
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            double sourceMs = std::chrono::duration<double, std::milli>(end - start).count();
+            lua_close(L);
+        
+            // ...or from the mapped bundle
+            start = std::chrono::high_resolution_clock::now();
+            ScriptBundle bundle(BUNDLE_PATH);
+            L = luaL_newstate();
+            if (bundle.RunAll(L) != LUA_OK)
+            {
+                printf("Error: %s\n", lua_tostring(L, -1));
+            }
+            end = std::chrono::high_resolution_clock::now();
+            double bundleMs = std::chrono::duration<double, std::milli>(end - start).count();
+        
+            lua_getglobal(L, "Script42");
+            lua_pushnumber(L, 1);
+            lua_pushnumber(L, 10);
+            lua_pcall(L, 2, 1, 0);
+            assert(lua_tonumber(L, -1) == 55 * 42);
+            lua_close(L);
+        
+            printf("%d scripts, from source: %.2fms, from mapped bundle: %.2fms\n", bundle.NumScripts(), sourceMs, bundleMs);
+            bundle.Unmap();
+            remove(BUNDLE_PATH);
+        }
+    }
+    
+    printf("---- Structure of arrays sprites ----\n");
+    {
+        // Per object: every sprite is a user datum, scripts call Move on each of them every frame
+        struct Sprite
+        {
+            float x;
+            float y;
+        };
+        
+        auto CreateSprite = [](lua_State* L) -> int
+        {
+            Sprite* sprite = (Sprite*) lua_newuserdata(L, sizeof(Sprite));
+            sprite->x = 0;
+            sprite->y = 0;
+            luaL_setmetatable(L, "SpriteMetaTable");
+            return 1;
+        };
+        
+        auto MoveSprite = [](lua_State* L) -> int
+        {
+            Sprite* sprite = (Sprite*) lua_touserdata(L, 1);
+            sprite->x += (float) lua_tonumber(L, 2);
+            sprite->y += (float) lua_tonumber(L, 3);
+            return 0;
+        };
+        
+        auto TimeScript = [](lua_State* L, const char* script) -> double
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            if (luaL_dostring(L, script) != LUA_OK)
+            {
+                printf("Error: %s\n", lua_tostring(L, -1));
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            return std::chrono::duration<double, std::milli>(end - start).count();
+        };
+        
+        // Same sprites in both: velocity (1, 2), 10 frames at 60fps
+        for (int numSprites = 10000; numSprites <= 1000000; numSprites *= 10)
+        {
+            lua_State* L = luaL_newstate();
+            
+            luaL_newmetatable(L, "SpriteMetaTable");
+            lua_newtable(L);
+            lua_pushcfunction(L, MoveSprite);
+            lua_setfield(L, -2, "Move");
+            lua_setfield(L, -2, "__index");
+            lua_pop(L, 1);
+            lua_pushcfunction(L, CreateSprite);
+            lua_setglobal(L, "NewSprite");
+            
+            // Structure of arrays: handles are indices, one Step for all of them
+            SpriteSystem spriteSystem;
+            spriteSystem.Reserve(numSprites);
+            spriteSystem.RegisterLuaTable(L);
+            
+            lua_pushinteger(L, numSprites);
+            lua_setglobal(L, "NUM_SPRITES");
+            TimeScript(L, "sprites = {} for i = 1, NUM_SPRITES do sprites[i] = NewSprite() SpriteSystem.new(0, 0, 1, 2) end");
+            
+            double perObjectMs = TimeScript(L, R"(
+                local sprites, dt = sprites, 1 / 60
+                for frame = 1, 10 do
+                    for i = 1, #sprites do
+                        sprites[i]:Move(dt, 2 * dt)
+                    end
+                end
+            )");
+            double systemMs = TimeScript(L, "local Step = SpriteSystem.Step for frame = 1, 10 do Step(1 / 60) end");
+            
+            printf("%7d sprites, 10 frames, per object Move: %.2fms, SpriteSystem.Step: %.2fms\n", numSprites, perObjectMs, systemMs);
+            lua_close(L);
+        }
+    }
+    
     printf("---- Upvalues and light user data ----\n");
     {
         // upvalues -> Store state in a C function
@@ -1034,8 +1928,9 @@ int main()
         {
             int x; // bad encaspulation
             int y;
+            uint64_t handle;    // In the SpriteManager
             
-            Sprite() : x(0), y(0)
+            Sprite() : x(0), y(0), handle(0)
             { }
             
             ~Sprite()
@@ -1054,9 +1949,10 @@ int main()
         };
         
         // Ex use case: Sprite manager
+        // Slot map: registering and forgetting a sprite are O(1) (every __gc forgets one, so no linear search + erase)
         struct SpriteManager
         {
-            std::vector<Sprite*> m_sprites;
+            SlotMap<Sprite*> m_sprites;
             int m_numberOfSpritesExisting;
             
             SpriteManager()
@@ -1068,23 +1964,23 @@ int main()
             void LookAfterSprite(Sprite* sprite)
             {
                 m_numberOfSpritesExisting++;
-                m_sprites.push_back(sprite);
+                sprite->handle = m_sprites.Insert(sprite);
             }
             
             void ForgetSprite(Sprite* sprite)
             {
-                int i = 0;
-                for (auto& s : m_sprites)
+                if (m_sprites.Remove(sprite->handle))
                 {
-                    if (s == sprite)
-                    {
-                        m_numberOfSpritesExisting--;
-                        m_sprites.erase(m_sprites.begin() + i);
-                        return;
-                    }
-                    i++;
+                    m_numberOfSpritesExisting--;
                 }
             }
+            
+            // nullptr once the sprite was collected. Slots get reused, a stale handle is detected until its slot generation wraps around
+            Sprite* FindSprite(uint64_t handle)
+            {
+                Sprite** sprite = m_sprites.Get(handle);
+                return sprite ? *sprite : nullptr;
+            }
         };
         
         // This will probably live as a long-lived service
@@ -1112,9 +2008,8 @@ int main()
             lua_setmetatable(L, -2);        // Set metatable to user datum Sprite. This command pops metatable off stack
             
             // USER TABLE:
-            // Stores any additional value to the native object that we didn't have at compile time
-            lua_newtable(L);
-            lua_setuservalue(L, 1);        // Associate this userdatum with the non-native table
+            // Stores any additional value to the native object that we didn't have at compile time.
+            // Created by __newindex the first time one is set: most sprites never need one
             
             // Notify the manager of a new sprite
             sm->LookAfterSprite((Sprite*) pointerToSprite);
@@ -1151,6 +2046,25 @@ int main()
             return 0;
         };
         
+        // Sprite.Exists(handle): a script may hold on to a handle after the sprite is gone
+        auto SpriteExists = [](lua_State* L) -> int
+        {
+            SpriteManager* sm = (SpriteManager*) lua_touserdata(L, lua_upvalueindex(1));
+            lua_pushboolean(L, sm->FindSprite((uint64_t) luaL_checkinteger(L, 1)) != nullptr);
+            return 1;
+        };
+        
+        // Native properties, found by pointer identity of their interned names (see PropertyDispatch.h)
+        PropertyDispatcher<Sprite>::Property spriteProperties[] =
+        {
+            { "x", [](lua_State* L, const Sprite& sprite) { lua_pushnumber(L, sprite.x); },
+                   [](lua_State* L, Sprite& sprite, int valueIdx) { sprite.x = (int) lua_tonumber(L, valueIdx); } },
+            { "y", [](lua_State* L, const Sprite& sprite) { lua_pushnumber(L, sprite.y); },
+                   [](lua_State* L, Sprite& sprite, int valueIdx) { sprite.y = (int) lua_tonumber(L, valueIdx); } },
+            { "handle", [](lua_State* L, const Sprite& sprite) { lua_pushinteger(L, (lua_Integer) sprite.handle); }, nullptr },
+        };
+        
+        // The strcmp chains this section started with, only kept to measure the dispatcher against
         auto SpriteIndex = [](lua_State* L) -> int
         {
             assert(lua_isuserdata(L, -2));    //1
@@ -1168,11 +2082,19 @@ int main()
                 lua_pushnumber(L, sprite->y);
                 return 1;
             }
+            else if (strcmp(index, "handle") == 0)
+            {
+                lua_pushinteger(L, (lua_Integer) sprite->handle);
+                return 1;
+            }
             else
             {
-                lua_getuservalue(L, 1);
-                lua_pushvalue(L, 2);
-                lua_gettable(L, -2);
+                // No user value table yet: nothing was stored, go straight to the methods
+                if (lua_getuservalue(L, 1) == LUA_TTABLE)
+                {
+                    lua_pushvalue(L, 2);
+                    lua_gettable(L, -2);
+                }
                 if (lua_isnil(L, -1))
                 {
                     lua_getglobal(L, "Sprite");
@@ -1202,8 +2124,14 @@ int main()
             }
             else
             {
-                // Get user value table associated with this user datum
-                lua_getuservalue(L, 1);    // 1 - table
+                // Get user value table associated with this user datum, created on the first dynamic field
+                if (lua_getuservalue(L, 1) != LUA_TTABLE)    // 1 - table
+                {
+                    lua_pop(L, 1);
+                    lua_newtable(L);
+                    lua_pushvalue(L, -1);
+                    lua_setuservalue(L, 1);
+                }
                 lua_pushvalue(L, 2);    // 2 - index
                 lua_pushvalue(L, 3);    // 3 - value
                 lua_settable(L, -3);
@@ -1223,6 +2151,8 @@ int main()
         sprite:Draw()
         Sprite.new()
         Sprite.new()
+        spriteHandle = sprite.handle
+        assert_exists = Sprite.Exists(spriteHandle)
         )";
         
         
@@ -1248,6 +2178,9 @@ int main()
         lua_setfield(L, -2, "Move");
         lua_pushcfunction(L, DrawSprite);
         lua_setfield(L, -2, "Draw");
+        lua_pushlightuserdata(L, &spriteManager);
+        lua_pushcclosure(L, SpriteExists, NUMBER_OF_UPVALUES);
+        lua_setfield(L, -2, "Exists");
         
         
         // We can attach a meta-tables to our Sprite to call the deconstruction upon GC!
@@ -1259,16 +2192,8 @@ int main()
         lua_pushcclosure(L, DestroySprite, NUMBER_OF_UPVALUES);
         lua_settable(L, -3);                    // Set meta table
         
-        // Add meta method for handling ":" sugar.
-        // __index is invoked when you try and do something and the operation doesn't exist
-        lua_pushstring(L, "__index");
-        lua_pushcfunction(L, SpriteIndex);
-        lua_settable(L, -3);
-        
-        // __newindex -> for writing
-        lua_pushstring(L, "__newindex");
-        lua_pushcfunction(L, SpriteNewIndex);
-        lua_settable(L, -3);
+        // __index (also handles ":" sugar) and __newindex: properties, then user values, then methods of the Sprite table
+        PropertyDispatcher<Sprite>::Bind(L, -1, spriteTableIdx, spriteProperties, 3);
         
         int err = luaL_dostring(L, LUA_FILE);
         if (err == LUA_OK)
@@ -1280,6 +2205,94 @@ int main()
             printf("Error: %s\n", lua_tostring(L, -1));
         }
         
+        // Iterating the manager walks a dense array
+        for (Sprite* sprite : spriteManager.m_sprites)
+        {
+            sprite->Draw();
+        }
+        
+        // Collect the sprite: its handle (kept by the script) must now be detected as stale
+        lua_getglobal(L, "spriteHandle");
+        uint64_t spriteHandle = (uint64_t) lua_tointeger(L, -1);
+        (void) spriteHandle;                    // Only read by asserts
+        lua_getglobal(L, "assert_exists");
+        assert(lua_toboolean(L, -1));
+        lua_pop(L, 2);
+        assert(spriteManager.FindSprite(spriteHandle) != nullptr);
+        
+        lua_pushnil(L);
+        lua_setglobal(L, "sprite");
+        lua_gc(L, LUA_GCCOLLECT, 0);
+        assert(spriteManager.FindSprite(spriteHandle) == nullptr);
+        
+        luaL_dostring(L, "assert_exists = Sprite.Exists(spriteHandle)");
+        lua_getglobal(L, "assert_exists");
+        assert(!lua_toboolean(L, -1));
+        lua_pop(L, 1);
+        
+        // Interned dispatch vs the strcmp chains + global lookup
+        auto TimeScript = [L](const char* script) -> double
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            if (luaL_dostring(L, script) != LUA_OK)
+            {
+                printf("Error: %s\n", lua_tostring(L, -1));
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            return std::chrono::duration<double, std::milli>(end - start).count();
+        };
+        
+        // Both dispatchers stay reachable, the metamethods are swapped between runs
+        luaL_getmetatable(L, "SpriteMetaTable");
+        lua_getfield(L, -1, "__index");
+        int internedIndexRef = luaL_ref(L, LUA_REGISTRYINDEX);
+        lua_getfield(L, -1, "__newindex");
+        int internedNewIndexRef = luaL_ref(L, LUA_REGISTRYINDEX);
+        lua_pop(L, 1);
+        
+        auto TimeDispatch = [&](bool interned) -> double
+        {
+            luaL_getmetatable(L, "SpriteMetaTable");
+            if (interned)
+            {
+                lua_rawgeti(L, LUA_REGISTRYINDEX, internedIndexRef);
+                lua_setfield(L, -2, "__index");
+                lua_rawgeti(L, LUA_REGISTRYINDEX, internedNewIndexRef);
+                lua_setfield(L, -2, "__newindex");
+            }
+            else
+            {
+                lua_pushcfunction(L, SpriteIndex);
+                lua_setfield(L, -2, "__index");
+                lua_pushcfunction(L, SpriteNewIndex);
+                lua_setfield(L, -2, "__newindex");
+            }
+            lua_pop(L, 1);
+            return TimeScript("local s = Sprite.new() for i = 1, 100000 do s.x = s.y + 1 s.y = s.x local draw = s.Draw end");
+        };
+        
+        // Warm-up pass of each, then alternate which goes first so neither always runs on a cold cache
+        constexpr int ROUNDS = 4;
+        TimeDispatch(true);
+        TimeDispatch(false);
+        double internedMs = 0.0;
+        double strcmpMs = 0.0;
+        for (int round = 0; round < ROUNDS; round++)
+        {
+            bool internedFirst = (round % 2) == 0;
+            double firstMs = TimeDispatch(internedFirst);
+            double secondMs = TimeDispatch(!internedFirst);
+            internedMs += internedFirst ? firstMs : secondMs;
+            strcmpMs += internedFirst ? secondMs : firstMs;
+        }
+        internedMs /= ROUNDS;
+        strcmpMs /= ROUNDS;
+        luaL_unref(L, LUA_REGISTRYINDEX, internedIndexRef);
+        luaL_unref(L, LUA_REGISTRYINDEX, internedNewIndexRef);
+        
+        printf("100000 x (2 property reads, 2 writes, 1 method lookup), strcmp: %.2fms, interned: %.2fms (%.1fx, average of %d runs)\n",
+               strcmpMs, internedMs, strcmpMs / internedMs, ROUNDS);
+        
         lua_close(L);
     
         